@@ -37,6 +37,14 @@ ifndef SOURCES
 SOURCES = NONE
 endif
 
+ifndef NEIGHBOUR_SEARCH
+NEIGHBOUR_SEARCH = GRID
+endif
+
+ifndef OPENMP
+OPENMP = false
+endif
+
 
 
 
@@ -164,6 +172,16 @@ endif
 
 
 
+ifeq ($(strip $(NEIGHBOUR_SEARCH)), GRID)
+NEIGHBOURINT = 1
+endif
+ifeq ($(strip $(NEIGHBOUR_SEARCH)), TREE)
+NEIGHBOURINT = 2
+endif
+
+
+
+
 ifeq ($(strip $(SOURCES)), NONE)
 SOURCESINT = 0
 endif
@@ -186,7 +204,8 @@ COMPILEDATE:=$(shell date "+%F %T")
 
 
 DEFINES= -DNDIM=$(NDIM) -DSOLVER=$(SOLVERINT) -DRIEMANN=$(RIEMANNINT) -DLIMITER=$(LIMITERINT) \
-	-DKERNEL=$(KERNELINT) -DSOURCE=$(SOURCESINT) -DCOMPDATE="$(COMPILEDATE)" 
+	-DKERNEL=$(KERNELINT) -DSOURCE=$(SOURCESINT) -DNEIGHBOUR_SEARCH=$(NEIGHBOURINT) \
+	-DCOMPDATE="$(COMPILEDATE)" 
 
 
 ifdef SPH
@@ -201,6 +220,10 @@ ifneq ($(strip $(SOURCES)), NONE)
 DEFINES += -DWITH_SOURCES
 endif
 
+ifeq ($(strip $(OPENMP)), true)
+OMPFLAGS = -fopenmp
+endif
+
 
 
 
@@ -265,28 +288,19 @@ endif
 
 
 
-ifeq ($(strip $(KERNEL)), CUBIC_SPLINE)
-KERNELOBJ = cubic_spline.o
-endif
-ifeq ($(strip $(KERNEL)), QUARTIC_SPLINE)
-KERNELOBJ = quartic_spline.o
-endif
-ifeq ($(strip $(KERNEL)), QUINTIC_SPLINE)
-KERNELOBJ = quintic_spline.o
-endif
-ifeq ($(strip $(KERNEL)), WENDLAND_C2)
-KERNELOBJ = wendlandC2.o
-endif
-ifeq ($(strip $(KERNEL)), WENDLAND_C4)
-KERNELOBJ = wendlandC4.o
+
+
+
+
+ifeq ($(strip $(NEIGHBOUR_SEARCH)), GRID)
+	NEIGHBOUROBJ=
 endif
-ifeq ($(strip $(KERNEL)), WENDLAND_C6)
-KERNELOBJ = wendlandC6.o
+ifeq ($(strip $(NEIGHBOUR_SEARCH)), TREE)
+	NEIGHBOUROBJ=tree.o
 endif
 
 
 
-
 ifeq ($(strip $(SOURCES)), NONE)
 	SRCOBJ=
 endif
@@ -315,4 +329,4 @@ endif
 
 
 # OBJECTS = main.o gas.o params.o particles.o io.o utils.o cell.o solver.o limiter.o $(HYDROOBJ) $(LIMITEROBJ) $(RIEMANNOBJ) $(SRCOBJ) $(INTOBJ)
-OBJECTS = main.o gas.o params.o particles.o io.o utils.o cell.o solver.o kernel.o sort.o $(HYDROOBJ) $(KERNELOBJ)
+OBJECTS = main.o gas.o params.o particles.o io.o utils.o cell.o solver.o kernel.o sort.o task.o boundary.o $(HYDROOBJ) $(NEIGHBOUROBJ)
@@ -0,0 +1,402 @@
+/* Boundary conditions: layers of image cells around the box, filled with
+ * image particles, so that neighbour loops never need to know about the
+ * boundaries */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "boundary.h"
+#include "cell.h"
+#include "defines.h"
+#include "params.h"
+#include "particles.h"
+#include "utils.h"
+
+extern params pars;
+extern partstore particles;
+extern cell *grid;
+extern int *cell_lookup;
+extern int *cell_stencil;
+extern cellhash cell_table;
+
+void boundary_init_cells(int nlayers) {
+  /* -------------------------------------------------------
+   * Surround the box with nlayers layers of image cells.
+   * Every image cell is a copy of the cell in the box it
+   * is an image of, moved and, for reflective boundaries,
+   * mirrored into place. With transmissive boundaries the
+   * image cells stay empty. Then every cell of the box
+   * has all its neighbours within nlayers cells, in the
+   * box or in the image layers, and can interact with
+   * them without checking for boundaries.
+   * Image cells are stored in the grid after the cells of
+   * the box, and get their particles with
+   * boundary_build_images(). Also sets up the cell lookup
+   * table for the padded grid and the stencil of cells
+   * around a cell, see cell_get_neighbours_within().
+   * The sparse grid only gets image cells of cells that
+   * exist, and puts them into the cell table instead.
+   * ------------------------------------------------------- */
+
+  log_extra("Setting up %d layers of image cells", nlayers);
+
+  /* get rid of the image cells we might have had so far */
+  for (int c = pars.ncelltot; c < pars.ncelltot + pars.ncellimg; c++) {
+    free(grid[c].sortd);
+    free(grid[c].sorti);
+  }
+
+#if NDIM == 1
+  int jlo = 0;
+  int jhi = 1;
+#elif NDIM == 2
+  int jlo = -nlayers;
+  int jhi = pars.nx + nlayers;
+#endif
+
+  pars.nimglayers = nlayers;
+
+#ifdef CELL_GRID_SPARSE
+
+  /* go through the image layers twice: count the image cells first, then
+   * set them up. Only the cells of the box are looked up, so the image
+   * cells we had so far don't get in the way. */
+  int nimgcells = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    if (pass == 1) {
+      pars.ncellimg = nimgcells;
+      grid = realloc(grid, (pars.ncelltot + nimgcells) * sizeof(cell));
+      if (grid == NULL) {
+        throw_error("Couldn't allocate %d image cells", nimgcells);
+      }
+      cell_hash_destroy(&cell_table);
+      cell_hash_init(&cell_table, pars.ncelltot + nimgcells);
+      for (int c = 0; c < pars.ncelltot; c++) {
+        int i, j;
+        cell_get_ij(&grid[c], &i, &j);
+        cell_hash_insert(&cell_table, i, j, c);
+      }
+    }
+
+    int c = pars.ncelltot;
+    for (int j = jlo; j < jhi; j++) {
+      for (int i = -nlayers; i < pars.nx + nlayers; i++) {
+        if (i == 0 && j >= 0 && j < pars.nx)
+          i = pars.nx; /* skip the box */
+
+        float flip[2] = {1., 1.};
+        float shift[2] = {0., 0.};
+        int si = boundary_get_source(i, pars.nx, &flip[0], &shift[0]);
+        int sj = 0;
+#if NDIM == 2
+        sj = boundary_get_source(j, pars.nx, &flip[1], &shift[1]);
+#endif
+        int src = -1;
+        if (si >= 0 && sj >= 0)
+          src = cell_hash_find(&cell_table, si, sj);
+        if (src < 0)
+          continue; /* the image of an empty cell is empty */
+
+        if (pass == 1) {
+          cell *C = &grid[c];
+          cell_init_cell(C);
+          C->id = c;
+          C->x = ((float)i + 0.5) * pars.dx;
+          C->y = ((float)j + 0.5) * pars.dx;
+          C->src = src;
+          for (int d = 0; d < 2; d++) {
+            C->flip[d] = flip[d];
+            C->shift[d] = shift[d];
+          }
+          cell_hash_insert(&cell_table, i, j, c);
+        }
+        c += 1;
+      }
+    }
+    nimgcells = c - pars.ncelltot;
+  }
+
+#else
+
+  int np = pars.nx + 2 * nlayers; /* cells per dimension with images */
+#if NDIM == 1
+  int npad = np;
+#elif NDIM == 2
+  int npad = np * np;
+#endif
+
+  pars.ncellimg = npad - pars.ncelltot;
+
+  grid = realloc(grid, npad * sizeof(cell));
+  free(cell_lookup);
+  cell_lookup = malloc(npad * sizeof(int));
+  if (grid == NULL || cell_lookup == NULL) {
+    throw_error("Couldn't allocate %d image cells", pars.ncellimg);
+  }
+
+  int c = pars.ncelltot;
+  for (int j = jlo; j < jhi; j++) {
+    for (int i = -nlayers; i < pars.nx + nlayers; i++) {
+      int l = (j - jlo) * np + i + nlayers;
+      if (i >= 0 && i < pars.nx && j >= 0 && j < pars.nx) {
+        cell_lookup[l] = cell_get_ind_from_ij(i, j);
+        grid[cell_lookup[l]].pad = l;
+        continue;
+      }
+
+      cell *C = &grid[c];
+      cell_init_cell(C);
+      C->id = c;
+      C->pad = l;
+      C->x = ((float)i + 0.5) * pars.dx;
+      C->y = ((float)j + 0.5) * pars.dx;
+
+      int si = boundary_get_source(i, pars.nx, &C->flip[0], &C->shift[0]);
+      int sj = 0;
+#if NDIM == 2
+      sj = boundary_get_source(j, pars.nx, &C->flip[1], &C->shift[1]);
+#endif
+      if (si >= 0 && sj >= 0)
+        C->src = cell_get_ind_from_ij(si, sj);
+
+      cell_lookup[l] = c;
+      c += 1;
+    }
+  }
+
+  /* The stencil holds the offsets in cell_lookup from a cell to the cells
+   * around it, ordered by distance: first the cell itself, then the ring
+   * of cells 1 cell away, and so on. The cells at most m cells away are
+   * the first (2m + 1)^NDIM entries. */
+  int nk = 2 * nlayers + 1;
+#if NDIM == 1
+  int nstencil = nk;
+#elif NDIM == 2
+  int nstencil = nk * nk;
+#endif
+  free(cell_stencil);
+  cell_stencil = malloc(nstencil * sizeof(int));
+  if (cell_stencil == NULL) {
+    throw_error("Couldn't allocate cell stencil");
+  }
+
+  cell_stencil[0] = 0;
+  int s = 1;
+  for (int m = 1; m <= nlayers; m++) {
+#if NDIM == 1
+    int mj = 0;
+#elif NDIM == 2
+    int mj = m;
+#endif
+    for (int dj = -mj; dj <= mj; dj++) {
+      for (int di = -m; di <= m; di++) {
+        if (abs(di) < m && abs(dj) < m)
+          continue; /* closer than m, already in there */
+        cell_stencil[s] = dj * np + di;
+        s += 1;
+      }
+    }
+  }
+#endif
+}
+
+int boundary_get_source(int i, int nx, float *flip, float *shift) {
+  /* -------------------------------------------------------
+   * For a grid with nx cells per dimension, find the cell
+   * of the box that the cell with index i along one
+   * dimension is an image of. i may lie outside of
+   * [0, nx). Positions x of the source cell map to
+   * flip * x + shift in the image cell.
+   * Returns the index of the source cell along that
+   * dimension, or -1 if the cell has no source, i.e. for
+   * transmissive boundaries.
+   * ------------------------------------------------------- */
+
+  /* how many box lengths i is away from the box, rounded down */
+  int p = i >= 0 ? i / nx : -((nx - 1 - i) / nx);
+
+  *flip = 1.;
+  *shift = 0.;
+
+  if (p == 0)
+    return (i);
+
+  if (pars.boundary == BOUNDARY_PERIODIC) {
+    *shift = p * BOXLEN;
+    return (i - p * nx);
+  } else if (pars.boundary == BOUNDARY_REFLECTIVE) {
+    /* an even number of reflections is a translation */
+    if (p % 2 == 0) {
+      *shift = p * BOXLEN;
+      return (i - p * nx);
+    }
+    *flip = -1.;
+    *shift = (p + 1) * BOXLEN;
+    return ((p + 1) * nx - 1 - i);
+  }
+
+  return (-1);
+}
+
+int boundary_count_images() {
+  /* -------------------------------------------------------
+   * Count how many image particles the image cells need,
+   * given the number of particles in the cells of the box.
+   * ------------------------------------------------------- */
+
+  int nimg = 0;
+  for (int c = pars.ncelltot; c < pars.ncelltot + pars.ncellimg; c++) {
+    if (grid[c].src >= 0)
+      nimg += grid[grid[c].src].npic;
+  }
+  return (nimg);
+}
+
+void boundary_build_images() {
+  /* -------------------------------------------------------
+   * Fill the image cells with image particles, stored in
+   * the particle store after the npart particles of the
+   * box. The particles of every image cell are in the
+   * same order as those of its source cell. Grows the
+   * particle store if needed.
+   * ------------------------------------------------------- */
+
+  int nimg = boundary_count_images();
+
+  if (pars.npart + nimg > particles.nalloc) {
+    debugmessage("Growing particle store for %d image particles", nimg);
+    partstore grown;
+    part_alloc_store(&grown, pars.npart + nimg);
+    for (int i = 0; i < pars.npart; i++) {
+      part_copy(&grown, i, &particles, i);
+    }
+    part_free_store(&particles);
+    particles = grown;
+  }
+  pars.nimage = nimg;
+
+  int offset = pars.npart;
+  for (int c = pars.ncelltot; c < pars.ncelltot + pars.ncellimg; c++) {
+    cell *C = &grid[c];
+    C->offset = offset;
+    C->npic = C->src >= 0 ? grid[C->src].npic : 0;
+    offset += C->npic;
+  }
+
+  boundary_update_images();
+}
+
+void boundary_update_images() {
+  /* -------------------------------------------------------
+   * Copy the particles of every source cell into its image
+   * cells, and move and mirror the copies into place.
+   * Particles that moved since the images were built keep
+   * their images, even if they moved to another cell, so
+   * this can be used to refresh the images after a drift.
+   * ------------------------------------------------------- */
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+  for (int c = pars.ncelltot; c < pars.ncelltot + pars.ncellimg; c++) {
+    cell *C = &grid[c];
+    if (C->npic == 0)
+      continue;
+    cell *S = &grid[C->src];
+    float center[2] = {C->x, C->y};
+
+    for (int k = 0; k < C->npic; k++) {
+      int I = C->offset + k;
+      int P = S->offset + k;
+      part_copy(&particles, I, &particles, P);
+      for (int d = 0; d < 2; d++) {
+        particles.x[d][I] = C->flip[d] * particles.x[d][P] + C->shift[d];
+        particles.cold[I].prim.u[d] *= C->flip[d];
+        particles.cold[I].cons.rhou[d] *= C->flip[d];
+        if (pars.boundary == BOUNDARY_PERIODIC) {
+          /* the particle may have wrapped around the box since */
+          float dx = particles.x[d][I] - center[d];
+          if (dx > 0.5 * BOXLEN)
+            particles.x[d][I] -= BOXLEN;
+          if (dx < -0.5 * BOXLEN)
+            particles.x[d][I] += BOXLEN;
+        }
+      }
+    }
+  }
+}
+
+void boundary_copy_to_images(float *a) {
+  /* -------------------------------------------------------
+   * Copy the values of a per-particle array a from the
+   * particles of the box to their image particles. a needs
+   * space for npart + nimage values.
+   * ------------------------------------------------------- */
+
+  for (int c = pars.ncelltot; c < pars.ncelltot + pars.ncellimg; c++) {
+    cell *C = &grid[c];
+    if (C->npic > 0)
+      memcpy(a + C->offset, a + grid[C->src].offset, C->npic * sizeof(float));
+  }
+}
+
+void boundary_enforce(int i) {
+  /* -------------------------------------------------------
+   * Put particle i back into the box after it moved:
+   * wrap it around periodic boundaries, or bounce it off
+   * reflective walls. Particles leave through transmissive
+   * boundaries.
+   * ------------------------------------------------------- */
+
+  for (int k = 0; k < NDIM; k++) {
+    float *x = &particles.x[k][i];
+    if (pars.boundary == BOUNDARY_PERIODIC) {
+      if (*x >= BOXLEN)
+        *x -= BOXLEN;
+      if (*x < 0.)
+        *x += BOXLEN;
+    } else if (pars.boundary == BOUNDARY_REFLECTIVE) {
+      if (*x < 0. || *x >= BOXLEN) {
+        *x = *x < 0. ? -*x : 2. * BOXLEN - *x;
+        particles.cold[i].prim.u[k] *= -1.;
+        particles.cold[i].cons.rhou[k] *= -1.;
+      }
+    }
+  }
+}
+
+void boundary_nearest_image(float *dx, float *dy) {
+  /* -------------------------------------------------------
+   * Turn the separation dx, dy of two particles into the
+   * separation to the nearest periodic image if the
+   * boundaries are periodic. For particle displacements.
+   * ------------------------------------------------------- */
+
+  if (pars.boundary == BOUNDARY_PERIODIC)
+    boundary_periodic_image(dx, dy);
+}
+
+int boundary_search_is_periodic() {
+  /* -------------------------------------------------------
+   * Whether separations of particles found by the
+   * neighbour search need to go to the nearest periodic
+   * image. The cell grid has image particles and never
+   * needs it; the tree has none.
+   * Loops over particle pairs check this once and pass the
+   * result on as a constant to an inline loop function, so
+   * the compiler makes a variant of the loop for either
+   * case, and the non-periodic one has no boundary checks
+   * in it.
+   * ------------------------------------------------------- */
+
+#if NEIGHBOUR_SEARCH == NGB_TREE
+  return (pars.boundary == BOUNDARY_PERIODIC);
+#else
+  return (0);
+#endif
+}
@@ -0,0 +1,38 @@
+/* Boundary conditions: layers of image cells around the box, filled with
+ * image particles, so that neighbour loops never need to know about the
+ * boundaries */
+
+#ifndef BOUNDARY_H
+#define BOUNDARY_H
+
+#include "defines.h"
+
+void boundary_init_cells(int nlayers);
+int boundary_get_source(int i, int nx, float *flip, float *shift);
+int boundary_count_images();
+void boundary_build_images();
+void boundary_update_images();
+void boundary_copy_to_images(float *a);
+void boundary_enforce(int i);
+void boundary_nearest_image(float *dx, float *dy);
+int boundary_search_is_periodic();
+
+static inline void boundary_periodic_image(float *dx, float *dy) {
+  /* -------------------------------------------------------
+   * Turn the separation dx, dy of two particles into the
+   * separation to the nearest periodic image, whatever the
+   * boundary conditions are. For loops that picked their
+   * variant for the boundary conditions beforehand.
+   * ------------------------------------------------------- */
+
+  if (*dx > 0.5 * BOXLEN)
+    *dx -= BOXLEN;
+  if (*dx < -0.5 * BOXLEN)
+    *dx += BOXLEN;
+  if (*dy > 0.5 * BOXLEN)
+    *dy -= BOXLEN;
+  if (*dy < -0.5 * BOXLEN)
+    *dy += BOXLEN;
+}
+
+#endif
@@ -7,17 +7,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "boundary.h"
 #include "cell.h"
 #include "defines.h"
 #include "gas.h"
 #include "params.h"
 #include "particles.h"
+#include "sort.h"
 #include "utils.h"
 
 extern cell *grid;
+extern int *cell_order;
+extern int *cell_lookup;
+extern int *cell_stencil;
+extern cellhalo halos;
+extern cellhash cell_table;
 extern params pars;
-extern part *particles;
+extern partstore particles;
 
 void cell_init_cell(cell *c) {
   /*---------------------------------------
@@ -29,17 +41,19 @@ void cell_init_cell(cell *c) {
   c->y = 0.;
 
   c->npic = 0;
-  c->cellpartsize = PARTS_ARRAY_SIZE;
-  c->cellparts = malloc(c->cellpartsize * sizeof(int));
-}
-
-void cell_destroy_cell(cell *c) {
-  /* --------------------------------------
-   * Destroy a cell.  In particular,
-   * dealloc the cellparts array.
-   * ------------------------------------- */
-
-  free(c->cellparts);
+  c->offset = 0;
+  c->pad = 0;
+  c->hoffset = 0;
+  c->nhalo = 0;
+
+  c->sortd = NULL;
+  c->sorti = NULL;
+
+  c->src = -1;
+  c->flip[0] = 1.;
+  c->flip[1] = 1.;
+  c->shift[0] = 0.;
+  c->shift[1] = 0.;
 }
 
 void cell_build_grid() {
@@ -47,43 +61,192 @@ void cell_build_grid() {
    * Build a useable grid.
    * Criterion for useable is that the number of particles
    * in a cell and all its direct neighbours is at least
-   * some factor of the number of neighbours set by the user
+   * some factor of the number of neighbours set by the user.
+   * First find the number of cells to use with
+   * cell_get_grid_size(), then build the grid once,
+   * surrounded by image cells for the boundaries.
    * ------------------------------------------------------- */
 
-  int nn; /* number of neighbours + 1*/
-  int neighs[9] = {0, 0, 0, 0, 0,
-                   0, 0, 0, 0}; /* indices of neighbours (and this cell) */
+  clock_t sizing_start = clock();
+  pars.nx = cell_get_grid_size();
+  clock_t sizing_end = clock();
 
-  char repeat = 1;
-  while (repeat) {
-    repeat = 0;
-    cell_init_grid();
-    cell_distribute_particles();
+  log_message("Grid sizing took %.3fs, got nx=%d\n",
+              (float)(sizing_end - sizing_start) / CLOCKS_PER_SEC, pars.nx);
 
-    for (int c = 0; c < pars.ncelltot; c++) {
-      cell_get_neighbours(&grid[c], neighs, &nn);
-      int parts = 0;
-      for (int n = 0; n < nn; n++) {
-        parts += grid[neighs[n]].npic;
+  cell_init_grid();
+  cell_distribute_particles();
+  boundary_build_images();
+#if H_SOLVER == H_SOLVE_SWEEPS || NDIM == 1
+  cell_sort_particles();
+#else
+  cell_build_halos();
+#endif
+}
+
+int cell_get_grid_size() {
+  /* -------------------------------------------------------
+   * Find the largest number of cells per dimension nx,
+   * starting from the initial guess pars.nx, for which
+   * every cell has at least
+   * CELL_MIN_PARTS_IN_NEIGHBOURHOOD_FACT * nngb particles
+   * in itself and its direct neighbours.
+   * Fewer cells mean more particles per cell, so we do a
+   * binary search over nx in [1, pars.nx]. Every trial
+   * only needs a histogram of the particle positions, no
+   * grid is allocated and no particles are moved.
+   * With the sparse grid, only cells with particles in
+   * them count, and there are at most npart of those.
+   * ------------------------------------------------------- */
+
+  int nxmax = pars.nx;
+#ifdef CELL_GRID_SPARSE
+  int *count = malloc(pars.npart * sizeof(int));
+#elif NDIM == 1
+  int *count = malloc(nxmax * sizeof(int));
+#elif NDIM == 2
+  int *count = malloc(nxmax * nxmax * sizeof(int));
+#endif
+
+  int ntrials = 1;
+  int nx = nxmax;
+
+  if (!cell_grid_size_is_valid(nxmax, count)) {
+    /* lo: largest nx known to work, hi: smallest nx known to fail */
+    int lo = 1;
+    int hi = nxmax;
+    while (hi - lo > 1) {
+      int mid = (lo + hi) / 2;
+      ntrials += 1;
+      if (cell_grid_size_is_valid(mid, count)) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+    if (lo == 1) {
+      ntrials += 1;
+      if (!cell_grid_size_is_valid(lo, count)) {
+        throw_error("Grid building: Got nx = 0. :(\n");
       }
+    }
+    nx = lo;
+  }
 
-      if ((float)parts < CELL_MIN_PARTS_IN_NEIGHBOURHOOD_FACT * pars.nngb) {
-        /* there are too few particles. We need to rebuild the grid. */
-        /* for more particles per cell, reduce number of cells. */
-        debugmessage("Cell %d has too few particles around the neighbours.",
-                     grid[c].id);
-        debugmessage("Expected minimum: %9.3f, I got: %d",
-                     CELL_MIN_PARTS_IN_NEIGHBOURHOOD_FACT * pars.nngb, parts);
-        debugmessage("Triggering grid rebuild.");
-        pars.nx -= 1;
-        if (pars.nx <= 0) {
-          throw_error("Grid building: Got nx = 0. :(\n");
-        }
-        repeat = 1;
-        break;
+  debugmessage("Grid sizing: tried %d grid sizes, nx=%d -> nx=%d", ntrials,
+               nxmax, nx);
+
+  free(count);
+  return (nx);
+}
+
+int cell_grid_size_is_valid(int nx, int *count) {
+  /* -------------------------------------------------------
+   * Check whether a grid with nx cells per dimension
+   * satisfies the minimal number of particles in every
+   * cell's neighbourhood. Returns 1 if it does, 0 otherwise.
+   * count: scratch array with space for (at least) the
+   *        total number of cells of this grid, or npart
+   *        with the sparse grid.
+   * With the sparse grid, empty cells have no particles
+   * that need neighbours, so only the occupied ones are
+   * checked. They are counted in a hash table, whose
+   * slots are then gone through instead of the cells.
+   * ------------------------------------------------------- */
+
+  int nxtemp = pars.nx; /* cell_get_neighbours works on pars.nx */
+  pars.nx = nx;
+
+  float dx = BOXLEN / (float)nx;
+
+#ifdef CELL_GRID_SPARSE
+  cellhash table;
+  cell_hash_init(&table, pars.npart);
+  int ncells = 0;
+#else
+#if NDIM == 1
+  int ncells = nx;
+#elif NDIM == 2
+  int ncells = nx * nx;
+#endif
+  for (int c = 0; c < ncells; c++) {
+    count[c] = 0;
+  }
+#endif
+
+  for (int P = 0; P < pars.npart; P++) {
+    int i = (int)(particles.x[0][P] / dx);
+    int j = (int)(particles.x[1][P] / dx);
+    if (i >= nx)
+      i = nx - 1;
+    if (j >= nx)
+      j = nx - 1;
+#ifdef CELL_GRID_SPARSE
+    int c = cell_hash_insert(&table, i, j, ncells);
+    if (c == ncells) {
+      count[c] = 0;
+      ncells += 1;
+    }
+    count[c] += 1;
+#else
+    count[cell_get_ind_from_ij(i, j)] += 1;
+#endif
+  }
+
+  int valid = 1;
+  float flip, shift; /* not needed here */
+#if NDIM == 1
+  int nj = 0;
+#elif NDIM == 2
+  int nj = 1;
+#endif
+
+#ifdef CELL_GRID_SPARSE
+  for (int c = 0; c < table.size; c++) {
+    if (table.val[c] < 0)
+      continue;
+    int i, j;
+    cell_hash_get_ij(&table, c, &i, &j);
+#else
+  for (int c = 0; c < ncells; c++) {
+    int i = c % nx;
+    int j = c / nx;
+#endif
+    /* count the particles in this cell and its neighbours, including the
+     * ones the image cells would get */
+    int parts = 0;
+    for (int dj = -nj; dj <= nj; dj++) {
+      int sj = boundary_get_source(j + dj, nx, &flip, &shift);
+      for (int di = -1; di <= 1; di++) {
+        int si = boundary_get_source(i + di, nx, &flip, &shift);
+        if (si < 0 || sj < 0)
+          continue;
+#ifdef CELL_GRID_SPARSE
+        int k = cell_hash_find(&table, si, sj);
+        if (k >= 0)
+          parts += count[k];
+#else
+        parts += count[cell_get_ind_from_ij(si, sj)];
+#endif
       }
     }
+
+    if ((float)parts < CELL_MIN_PARTS_IN_NEIGHBOURHOOD_FACT * pars.nngb) {
+      /* there are too few particles. */
+      debugmessage("Grid sizing: nx=%d: Cell %d has too few particles around "
+                   "the neighbours. Expected minimum: %9.3f, I got: %d",
+                   nx, c, CELL_MIN_PARTS_IN_NEIGHBOURHOOD_FACT * pars.nngb,
+                   parts);
+      valid = 0;
+      break;
+    }
   }
+
+#ifdef CELL_GRID_SPARSE
+  cell_hash_destroy(&table);
+#endif
+  pars.nx = nxtemp;
+  return (valid);
 }
 
 void cell_init_grid() {
@@ -91,19 +254,61 @@ void cell_init_grid() {
    * Initialize the grid: Allocate memory for the cells,
    * initialize them, then distribute their position.
    * The "grid" is just a 1D array of cells.
+   * The sparse grid only gets the cells that have
+   * particles in them, in row major order, and puts them
+   * into the cell table.
    *----------------------------------------------------*/
 
   log_extra("Initializing grid");
 
+  /* update dx for the nx we ended up with */
+  pars.dx = BOXLEN / (float)pars.nx;
+
+#ifdef CELL_GRID_SPARSE
+  /* find the occupied cells. Keys are the row major cell indices */
+  int64_t *keys = malloc(pars.npart * sizeof(int64_t));
+  cell_hash_init(&cell_table, pars.npart);
+  int ncells = 0;
+  for (int P = 0; P < pars.npart; P++) {
+    int i = (int)(particles.x[0][P] / pars.dx);
+    int j = (int)(particles.x[1][P] / pars.dx);
+    if (i >= pars.nx)
+      i = pars.nx - 1;
+    if (j >= pars.nx)
+      j = pars.nx - 1;
+    if (cell_hash_insert(&cell_table, i, j, ncells) == ncells) {
+      keys[ncells] = (int64_t)j * pars.nx + i;
+      ncells += 1;
+    }
+  }
+  qsort(keys, ncells, sizeof(int64_t), cell_compare_keys);
+
+  pars.ncelltot = ncells;
+  grid = malloc(pars.ncelltot * sizeof(cell));
+  cell_hash_destroy(&cell_table);
+  cell_hash_init(&cell_table, pars.ncelltot);
+
+  for (int c = 0; c < pars.ncelltot; c++) {
+    cell_init_cell(&grid[c]);
+    grid[c].id = c;
+    int i = (int)(keys[c] % pars.nx);
+    int j = (int)(keys[c] / pars.nx);
+    grid[c].x = ((float)i + 0.5) * pars.dx;
+    grid[c].y = ((float)j + 0.5) * pars.dx;
+    cell_hash_insert(&cell_table, i, j, c);
+  }
+  free(keys);
+
+  log_extra("Sparse grid: %d of %d cells have particles", pars.ncelltot,
+            pars.nx * pars.nx);
+#else
+
 #if NDIM == 1
   pars.ncelltot = pars.nx;
 #elif NDIM == 2
   pars.ncelltot = pars.nx * pars.nx;
 #endif
 
-  /* update dx here in case we're reiterating*/
-  pars.dx = BOXLEN / (float)pars.nx;
-
   grid = malloc(pars.ncelltot * sizeof(cell));
 
   for (int c = 0; c < pars.ncelltot; c++) {
@@ -114,6 +319,14 @@ void cell_init_grid() {
     grid[c].x = ((float)i + 0.5) * pars.dx;
     grid[c].y = ((float)j + 0.5) * pars.dx;
   }
+#endif
+
+  cell_order = malloc(pars.ncelltot * sizeof(int));
+  cell_get_order(cell_order);
+
+  /* one layer of image cells covers the direct neighbours of every cell.
+   * The density sweeps add more if they need them. */
+  boundary_init_cells(1);
 
   /* debugging checks and messages */
   if (pars.verbose >= 3) {
@@ -122,6 +335,123 @@ void cell_init_grid() {
   }
 }
 
+void cell_get_order(int *order) {
+  /*----------------------------------------------------
+   * Get the order in which cells (and their particles)
+   * are laid out in memory and traversed: Write the cell
+   * indices into order[], sorted along the space filling
+   * curve selected via CELL_ORDER. order must have space
+   * for ncelltot integers.
+   * Keys are computed on a grid padded to the next power
+   * of 2, so they are unique but not contiguous. Just
+   * put every cell in its key's slot and compact. The
+   * sparse grid may have far fewer cells than slots, so
+   * sort its cells by key instead.
+   *----------------------------------------------------*/
+
+#if NDIM == 2 && CELL_ORDER != SFC_NONE
+
+  int n = 1;
+  while (n < pars.nx) {
+    n *= 2;
+  }
+
+#ifdef CELL_GRID_SPARSE
+  /* key in the upper, cell index in the lower 32 bits */
+  int64_t *keys = malloc(pars.ncelltot * sizeof(int64_t));
+  for (int c = 0; c < pars.ncelltot; c++) {
+    int i, j;
+    cell_get_ij(&grid[c], &i, &j);
+#if CELL_ORDER == SFC_MORTON
+    keys[c] = ((int64_t)cell_morton_key(i, j) << 32) | c;
+#elif CELL_ORDER == SFC_HILBERT
+    keys[c] = ((int64_t)cell_hilbert_key(n, i, j) << 32) | c;
+#endif
+  }
+  qsort(keys, pars.ncelltot, sizeof(int64_t), cell_compare_keys);
+  for (int o = 0; o < pars.ncelltot; o++) {
+    order[o] = (int)(keys[o] & 0xffffffff);
+  }
+  free(keys);
+#else
+
+  int *slots = malloc(n * n * sizeof(int));
+  for (int k = 0; k < n * n; k++) {
+    slots[k] = -1;
+  }
+
+  for (int c = 0; c < pars.ncelltot; c++) {
+    int i, j;
+    cell_get_ij(&grid[c], &i, &j);
+#if CELL_ORDER == SFC_MORTON
+    slots[cell_morton_key(i, j)] = c;
+#elif CELL_ORDER == SFC_HILBERT
+    slots[cell_hilbert_key(n, i, j)] = c;
+#endif
+  }
+
+  int o = 0;
+  for (int k = 0; k < n * n; k++) {
+    if (slots[k] >= 0) {
+      order[o] = slots[k];
+      o += 1;
+    }
+  }
+
+  free(slots);
+#endif
+
+#else
+
+  /* row major order */
+  for (int c = 0; c < pars.ncelltot; c++) {
+    order[c] = c;
+  }
+
+#endif
+}
+
+int cell_morton_key(int i, int j) {
+  /*----------------------------------------------------
+   * Get the Morton (Z-order) key of the cell with
+   * indices i, j by interleaving their bits.
+   *----------------------------------------------------*/
+
+  int key = 0;
+  for (int b = 0; b < 15; b++) {
+    key |= ((i >> b) & 1) << (2 * b);
+    key |= ((j >> b) & 1) << (2 * b + 1);
+  }
+  return (key);
+}
+
+int cell_hilbert_key(int n, int i, int j) {
+  /*----------------------------------------------------
+   * Get the index along the Hilbert curve of the cell
+   * with indices i, j on a n x n grid. n must be a
+   * power of 2.
+   *----------------------------------------------------*/
+
+  int key = 0;
+  for (int s = n / 2; s > 0; s /= 2) {
+    int ri = (i & s) > 0;
+    int rj = (j & s) > 0;
+    key += s * s * ((3 * ri) ^ rj);
+
+    /* rotate the quadrant */
+    if (rj == 0) {
+      if (ri == 1) {
+        i = n - 1 - i;
+        j = n - 1 - j;
+      }
+      int temp = i;
+      i = j;
+      j = temp;
+    }
+  }
+  return (key);
+}
+
 void cell_destroy_grid() {
   /* -------------------------------------
    * dealloc the grid
@@ -129,42 +459,133 @@ void cell_destroy_grid() {
 
   log_extra("Deallocating grid");
 
-  for (int i = 0; i < pars.ncelltot; i++) {
-    cell_destroy_cell(&grid[i]);
+  for (int c = 0; c < pars.ncelltot + pars.ncellimg; c++) {
+    free(grid[c].sortd);
+    free(grid[c].sorti);
   }
-
   free(grid);
+  free(cell_order);
+  free(cell_lookup);
+  free(cell_stencil);
+  free(halos.ind);
+  free(halos.x);
+  free(halos.y);
+  cell_hash_destroy(&cell_table);
+  halos.ind = NULL;
+  halos.x = NULL;
+  halos.y = NULL;
+  halos.n = 0;
+  grid = NULL;
+  cell_order = NULL;
+  cell_lookup = NULL;
+  cell_stencil = NULL;
+  pars.nimglayers = 0;
+  pars.ncellimg = 0;
+  pars.nimage = 0;
 }
 
 void cell_distribute_particles() {
-  /* --------------------------------------------
-   * Distribute particles into the cells
-   * and store them in the particle arrays of the
-   * cells
-   * -------------------------------------------- */
+  /* ---------------------------------------------------
+   * Distribute particles into the cells with a counting
+   * sort: First find every particle's cell index and
+   * count the particles per cell (histogram), then get
+   * the offset of each cell in the particle array via a
+   * prefix sum, and finally scatter the particles into a
+   * new, cell-ordered particle store.
+   * Afterwards, the particles of cell c are stored
+   * contiguously at indices grid[c].offset to
+   * grid[c].offset + grid[c].npic - 1.
+   *
+   * The particle array is split into chunks which are
+   * histogrammed and scattered independently, so with
+   * OpenMP every thread works on its own chunk. Within
+   * a cell, particles keep their relative order, so the
+   * result doesn't depend on the number of chunks.
+   * --------------------------------------------------- */
 
   log_extra("Distributing particles into cells");
 
-  for (int P = 0; P < pars.npart; P++) {
-    part p = particles[P];
+  int nchunks = 1;
+#ifdef _OPENMP
+  nchunks = omp_get_max_threads();
+#endif
+  int chunksize = pars.npart / nchunks + 1;
+
+  int *cellind = malloc(pars.npart * sizeof(int)); /* cell index of particle */
+  int *chunkcount = calloc(nchunks * pars.ncelltot, sizeof(int));
 
-    /* get x/y indices */
-    int i = (int)(p.x[0] / (float)pars.dx);
-    int j = (int)(p.x[1] / (float)pars.dx);
+  /* get cell indices and count particles per cell for each chunk */
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+  for (int k = 0; k < nchunks; k++) {
+    int *count = chunkcount + k * pars.ncelltot;
+    int stop = (k + 1) * chunksize;
+    if (stop > pars.npart)
+      stop = pars.npart;
+    for (int P = k * chunksize; P < stop; P++) {
+      /* get x/y indices */
+      int i = (int)(particles.x[0][P] / (float)pars.dx);
+      int j = (int)(particles.x[1][P] / (float)pars.dx);
+
+      /* safety checks */
+      if (i >= pars.nx) {
+        printf("In cell_distribute_particles: got i>=nx. p.x=%f\n",
+               particles.x[0][P]);
+        i = pars.nx - 1;
+      }
+      if (j >= pars.nx) {
+        printf("In cell_distribute_particles: got j>=nx. p.y=%f\n",
+               particles.x[1][P]);
+        j = pars.nx - 1;
+      }
 
-    /* safety checks */
-    if (i >= pars.nx) {
-      printf("In cell_distribute_particles: got i>=nx. p.x=%f\n", p.x[0]);
+      /* now get cell index */
+      cellind[P] = cell_get_ind_from_ij(i, j);
+      count[cellind[P]] += 1;
     }
-    if (j >= pars.nx) {
-      printf("In cell_distribute_particles: got j>=nx. p.y=%f\n", p.x[1]);
+  }
+
+  /* prefix sum over cells, and chunks within a cell. After this,
+   * chunkcount holds the index where chunk k writes its next particle
+   * of cell c to. Cells are laid out in the order given by cell_order. */
+  int offset = 0;
+  for (int o = 0; o < pars.ncelltot; o++) {
+    int c = cell_order[o];
+    grid[c].offset = offset;
+    for (int k = 0; k < nchunks; k++) {
+      int temp = chunkcount[k * pars.ncelltot + c];
+      chunkcount[k * pars.ncelltot + c] = offset;
+      offset += temp;
     }
+    grid[c].npic = offset - grid[c].offset;
+  }
 
-    /* now get cell index  and cell*/
-    int ind = j * pars.nx + i;
-    cell_add_particle(&grid[ind], P);
+  /* leave space for the image particles after the particles of the box */
+  partstore sorted;
+  part_alloc_store(&sorted, pars.npart + boundary_count_images());
+
+  /* scatter particles into their new place */
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+  for (int k = 0; k < nchunks; k++) {
+    int *next = chunkcount + k * pars.ncelltot;
+    int stop = (k + 1) * chunksize;
+    if (stop > pars.npart)
+      stop = pars.npart;
+    for (int P = k * chunksize; P < stop; P++) {
+      part_copy(&sorted, next[cellind[P]], &particles, P);
+      next[cellind[P]] += 1;
+    }
   }
 
+  part_free_store(&particles);
+  particles = sorted;
+
+  free(cellind);
+  free(chunkcount);
+
   /* debugging notes and checks */
   if (pars.verbose >= 3) {
     int npmin = pars.npart;
@@ -184,30 +605,158 @@ void cell_distribute_particles() {
   }
 }
 
-void cell_add_particle(cell *c, int pind) {
-  /* --------------------------------------------
-   * Add a particle index pind to a cell particle
-   * array
-   * -------------------------------------------- */
+void cell_sort_particles() {
+  /* ---------------------------------------------------
+   * Sort the particles of every cell, image cells
+   * included, along each of the CELL_NSORT axes between
+   * neighbouring cells, and store their projections
+   * onto the axis and their indices in that order in the
+   * cell. Interactions between two cells can then walk
+   * through both cells along the axis between them and
+   * stop as soon as the projected distance alone is
+   * larger than the search radius. The orderings stay
+   * valid until the grid is rebuilt. Cells that are
+   * sorted already are skipped, so this also takes care
+   * of image cells that were added later.
+   * --------------------------------------------------- */
+
+  log_extra("Sorting particles in cells");
+
+#if NDIM == 1
+  const float axes[CELL_NSORT][2] = {{1., 0.}};
+#elif NDIM == 2
+  const float d = 0.70710678; /* 1/sqrt(2) */
+  const float axes[CELL_NSORT][2] = {{1., 0.}, {0., 1.}, {d, d}, {d, -d}};
+#endif
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+  for (int c = 0; c < pars.ncelltot + pars.ncellimg; c++) {
+    cell *C = &grid[c];
+    if (C->npic == 0 || C->sortd != NULL)
+      continue;
+
+    C->sortd = malloc(CELL_NSORT * C->npic * sizeof(float));
+    C->sorti = malloc(CELL_NSORT * C->npic * sizeof(int));
+    if (C->sortd == NULL || C->sorti == NULL) {
+      throw_error("Couldn't allocate sort arrays for cell %d", c);
+    }
+
+    for (int a = 0; a < CELL_NSORT; a++) {
+      float *sd = C->sortd + a * C->npic;
+      int *si = C->sorti + a * C->npic;
+      for (int k = 0; k < C->npic; k++) {
+        int P = C->offset + k;
+        sd[k] = axes[a][0] * particles.x[0][P] + axes[a][1] * particles.x[1][P];
+        si[k] = P;
+      }
+      quicksort_float_int_follower(sd, si, C->npic);
+    }
+  }
+}
 
-  if (c->npic == c->cellpartsize) {
-    /* we need to make a new array with more space */
-    int *newarr = malloc((c->cellpartsize + PARTS_ARRAY_SIZE) * sizeof(int));
+void cell_build_halos() {
+  /* ---------------------------------------------------
+   * Fill the halo cache: for every cell of the box, the
+   * indices and positions of the particles of the cell
+   * and its direct neighbours, packed one after the
+   * other. Loops over the particles of a cell find all
+   * their neighbour candidates there, contiguous, and
+   * don't need to gather them from the neighbour cells
+   * again. The halos are laid out in the order the
+   * cells are traversed in, see cell_order. They stay
+   * valid until the grid is rebuilt, i.e. until
+   * particles may have moved to other cells, or the
+   * image cells change. Then build them again.
+   * --------------------------------------------------- */
+
+  log_extra("Building cell halos");
+
+  free(halos.ind);
+  free(halos.x);
+  free(halos.y);
+
+  int n = 0;
+  for (int o = 0; o < pars.ncelltot; o++) {
+    cell *C = &grid[cell_order[o]];
+    int neighs[9];
+    int nn;
+    cell_get_neighbours(C, neighs, &nn);
+    C->hoffset = n;
+    C->nhalo = 0;
+    for (int k = 0; k < nn; k++) {
+      C->nhalo += grid[neighs[k]].npic;
+    }
+    n += C->nhalo;
+  }
 
-    /* copy the data into new array */
-    for (int i = 0; i < c->cellpartsize; i++) {
-      newarr[i] = c->cellparts[i];
+  halos.n = n;
+  halos.ind = malloc(n * sizeof(int));
+  halos.x = malloc(n * sizeof(float));
+  halos.y = malloc(n * sizeof(float));
+  if (halos.ind == NULL || halos.x == NULL || halos.y == NULL) {
+    throw_error("Couldn't allocate cell halos with %d entries", n);
+  }
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+  for (int c = 0; c < pars.ncelltot; c++) {
+    cell *C = &grid[c];
+    int neighs[9];
+    int nn;
+    cell_get_neighbours(C, neighs, &nn);
+    int f = C->hoffset;
+    for (int k = 0; k < nn; k++) {
+      cell *N = &grid[neighs[k]];
+      for (int P = N->offset; P < N->offset + N->npic; P++) {
+        halos.ind[f] = P;
+        halos.x[f] = particles.x[0][P];
+        halos.y[f] = particles.x[1][P];
+        f += 1;
+      }
     }
+  }
+}
 
-    /* now free the old array and switch to the new one */
-    free(c->cellparts);
-    c->cellparts = newarr;
-    c->cellpartsize += PARTS_ARRAY_SIZE;
+int cell_get_pair_axis(cell *A, cell *B, int *axis) {
+  /* ---------------------------------------------------
+   * Find the sort axis between the neighbouring cells A
+   * and B, see cell_sort_particles(). Either may be an
+   * image cell.
+   * Returns +1 if the axis points from A towards B, -1
+   * if it points from B towards A, and 0 if the cells
+   * aren't direct neighbours.
+   * --------------------------------------------------- */
+
+  int ia, ja, ib, jb;
+  cell_get_ij(A, &ia, &ja);
+  cell_get_ij(B, &ib, &jb);
+  int di = ib - ia;
+  int dj = jb - ja;
+
+  if (di < -1 || di > 1 || dj < -1 || dj > 1 || (di == 0 && dj == 0))
+    return (0);
+
+  int sign = 1;
+  if (di < 0 || (di == 0 && dj < 0)) {
+    sign = -1;
+    di = -di;
+    dj = -dj;
   }
 
-  /* now actually add the new particle */
-  c->cellparts[c->npic] = pind;
-  c->npic += 1;
+  if (dj == 0) {
+    *axis = 0;
+  } else if (di == 0) {
+    *axis = 1;
+  } else if (dj == 1) {
+    *axis = 2;
+  } else {
+    *axis = 3;
+  }
+
+  return (sign);
 }
 
 void cell_get_neighbours(cell *c, int neighs[9], int *nneighs) {
@@ -219,215 +768,267 @@ void cell_get_neighbours(cell *c, int neighs[9], int *nneighs) {
    * First entry of neighs[] array is always the cell itself,
    * so you can just loop over the neighs array from 0 to
    * nneighs
+   * Neighbours across the boundaries are image cells, so
+   * every cell of the box has 3^NDIM entries, whatever the
+   * boundary conditions.
+   * --------------------------------------------------------- */
+
+  cell_get_neighbours_within(c, 1, neighs, nneighs);
+}
+
+void cell_get_neighbours_within(cell *c, int m, int *neighs, int *nneighs) {
+  /* ---------------------------------------------------------
+   * Find the indices of all cells that are at most m cells
+   * away from this cell in every dimension and write them
+   * into the neighs array, this cell first. Write how many
+   * entries are in that array in nneighs integer.
+   * Cells across the boundaries are image cells. Up to
+   * m = pars.nimglayers, the cells come straight from the
+   * stencil, nearest first. Beyond that, the cells are cut
+   * off where the image layers end. neighs needs space for
+   * (2m + 1)^NDIM entries.
+   * A particle in this cell is at least m * dx away from
+   * any cell that isn't listed.
+   * The sparse grid has no lookup table; its cells are
+   * looked up in the cell table, in the same order, and
+   * cells that aren't there are empty and left out.
    * --------------------------------------------------------- */
 
-  *nneighs = 0;
+  int g = pars.nimglayers;
 
+#ifdef CELL_GRID_SPARSE
+  int i, j;
+  cell_get_ij(c, &i, &j);
 #if NDIM == 1
+  int nj = 0;
+#elif NDIM == 2
+  int nj = 1;
+#endif
 
-  /* add the cell itself first */
   neighs[0] = c->id;
   *nneighs = 1;
 
-  /* periodic boundary conditions */
-  if (pars.boundary == 0) {
-
-    /* left boundary */
-    if (c->id == 0) {
-      neighs[*nneighs] = pars.nx - 1;
-    } else {
-      neighs[*nneighs] = c->id - 1;
+  if (m <= g) {
+    /* rings of cells further and further out, like the stencil */
+    for (int r = 1; r <= m; r++) {
+      for (int dj = -nj * r; dj <= nj * r; dj++) {
+        for (int di = -r; di <= r; di++) {
+          if (abs(di) < r && abs(dj) < r)
+            continue;
+          int k = cell_hash_find(&cell_table, i + di, j + dj);
+          if (k >= 0) {
+            neighs[*nneighs] = k;
+            *nneighs += 1;
+          }
+        }
+      }
     }
-    *nneighs += 1;
+    return;
+  }
 
-    /* right boundary */
-    if (c->id == pars.nx - 1) {
-      neighs[*nneighs] = 0;
-    } else {
-      neighs[*nneighs] = c->id + 1;
+  /* no cells beyond the image layers, so don't look for them there */
+  int lo = -g;
+  int hi = pars.nx + g - 1;
+  for (int jj = j - nj * m; jj <= j + nj * m; jj++) {
+    if (nj && (jj < lo || jj > hi))
+      continue;
+    for (int ii = i - m; ii <= i + m; ii++) {
+      if (ii < lo || ii > hi || (ii == i && jj == j))
+        continue;
+      int k = cell_hash_find(&cell_table, ii, jj);
+      if (k >= 0) {
+        neighs[*nneighs] = k;
+        *nneighs += 1;
+      }
     }
-    *nneighs += 1;
   }
 
-  /* transmissive boundary conditions */
-  else if (pars.boundary == 1) {
+#else
 
-    /* left boundary */
-    if (c->id > 0) {
-      neighs[*nneighs] = c->id - 1;
-    }
-    *nneighs += 1;
+  int nk = 2 * m + 1;
 
-    /* right boundary */
-    if (c->id < pars.nx - 1) {
-      neighs[*nneighs] = c->id + 1;
+  if (m <= g) {
+#if NDIM == 1
+    *nneighs = nk;
+#elif NDIM == 2
+    *nneighs = nk * nk;
+#endif
+    for (int k = 0; k < *nneighs; k++) {
+      neighs[k] = cell_lookup[c->pad + cell_stencil[k]];
     }
-    *nneighs += 1;
+    return;
   }
 
+  /* position of this cell in the padded grid */
+  int np = pars.nx + 2 * g;
+  int i = c->pad % np;
+  int j = c->pad / np;
+#if NDIM == 1
+  int mj = 0;
 #elif NDIM == 2
+  int mj = m;
+#endif
 
-  /* first get indices in x and y direction. */
-  int i, j;
-  cell_get_ij(c, &i, &j);
-
-  /* periodic boundary conditions */
-  int left, right, top,
-      bottom; /* indices of left, right, top, bottom rows/columns */
-  if (pars.boundary == 0) {
-
-    /* left boundary */
-    if (i == 0) {
-      left = pars.nx - 1;
-    } else {
-      left = i - 1;
-    }
-
-    /* right boundary */
-    if (i == pars.nx - 1) {
-      right = 0;
-    } else {
-      right = i + 1;
-    }
-
-    /* top boundary */
-    if (j == pars.nx - 1) {
-      top = 0;
-    } else {
-      top = j + 1;
-    }
-
-    /* bottom boundary */
-    if (j == 0) {
-      bottom = pars.nx - 1;
-    } else {
-      bottom = j - 1;
+  neighs[0] = c->id;
+  *nneighs = 1;
+  for (int jj = j - mj; jj <= j + mj; jj++) {
+    if (jj < 0 || jj >= np)
+      continue;
+    for (int ii = i - m; ii <= i + m; ii++) {
+      if (ii < 0 || ii >= np || (ii == i && jj == j))
+        continue;
+      neighs[*nneighs] = cell_lookup[jj * np + ii];
+      *nneighs += 1;
     }
+  }
+#endif
+}
 
-    /* now add neighbours to array */
-    /* always first add cell itself */
-    neighs[*nneighs] = cell_get_ind_from_ij(i, j);
-    *nneighs += 1;
-    neighs[*nneighs] = cell_get_ind_from_ij(left, bottom);
-    *nneighs += 1;
-    neighs[*nneighs] = cell_get_ind_from_ij(left, j);
-    *nneighs += 1;
-    neighs[*nneighs] = cell_get_ind_from_ij(left, top);
-    *nneighs += 1;
-    neighs[*nneighs] = cell_get_ind_from_ij(i, bottom);
-    *nneighs += 1;
-    neighs[*nneighs] = cell_get_ind_from_ij(i, top);
-    *nneighs += 1;
-    neighs[*nneighs] = cell_get_ind_from_ij(right, bottom);
-    *nneighs += 1;
-    neighs[*nneighs] = cell_get_ind_from_ij(right, j);
-    *nneighs += 1;
-    neighs[*nneighs] = cell_get_ind_from_ij(right, top);
-    *nneighs += 1;
-
-  }
-
-  /* transmissive boundary conditions */
-  else if (pars.boundary == 1) {
-
-    /* initialize all indices to -1 */
-    left = -1;
-    right = -1;
-    top = -1;
-    bottom = -1;
-
-    /* left boundary */
-    if (i != 0) {
-      left = i - 1;
-    }
+int cell_get_ind_from_ij(int i, int j) {
+  /* --------------------------------------------
+   * Compute cell index in grid from given i, j.
+   * The sparse grid looks it up in the cell
+   * table; returns -1 if there is no cell at
+   * i, j.
+   * -------------------------------------------- */
 
-    /* right boundary */
-    if (i != pars.nx - 1) {
-      right = i + 1;
-    }
+#ifdef CELL_GRID_SPARSE
+  return (cell_hash_find(&cell_table, i, j));
+#else
+  return (j * pars.nx + i);
+#endif
+}
 
-    /* top boundary */
-    if (j != pars.nx - 1) {
-      top = j + 1;
-    }
+void cell_get_ij(cell *c, int *i, int *j) {
+  /* ------------------------------------------------
+   * Compute the i and j value of a cell such that
+   * it can be addressed in the grid[] array.
+   * Image cells lie outside of [0, nx).
+   * ------------------------------------------------ */
 
-    /* bottom boundary */
-    if (j != 0) {
-      bottom = j - 1;
-    }
+#ifndef CELL_GRID_SPARSE
+  if (c->id < pars.ncelltot) {
+#if NDIM == 1
+    *i = c->id;
+    *j = 0;
+#elif NDIM == 2
+    *i = c->id % pars.nx;
+    *j = c->id / pars.nx;
+#endif
+    return;
+  }
+#endif
 
-    /* now add the neighbours if they exist */
-    /* always first add cell itself */
-    neighs[*nneighs] = cell_get_ind_from_ij(i, j);
-    *nneighs += 1;
+  /* image cells, and all cells of the sparse grid: from their centre */
+  *i = (int)floorf(c->x / pars.dx);
+  *j = NDIM == 2 ? (int)floorf(c->y / pars.dx) : 0;
+}
 
-    if (left != -1) {
+int cell_compare_keys(const void *a, const void *b) {
+  /* ------------------------------------------------
+   * Compare two int64_t keys for qsort().
+   * ------------------------------------------------ */
 
-      neighs[*nneighs] = cell_get_ind_from_ij(left, j);
-      *nneighs += 1;
+  int64_t ka = *(const int64_t *)a;
+  int64_t kb = *(const int64_t *)b;
+  return ((ka > kb) - (ka < kb));
+}
 
-      if (bottom != -1) {
-        neighs[*nneighs] = cell_get_ind_from_ij(left, bottom);
-        *nneighs += 1;
-      }
+static inline int64_t cell_hash_key(int i, int j) {
+  /* pack the cell indices i, j into a single key */
+  return ((int64_t)(((uint64_t)(uint32_t)j << 32) | (uint32_t)i));
+}
 
-      if (top != -1) {
-        neighs[*nneighs] = cell_get_ind_from_ij(left, top);
-        *nneighs += 1;
-      }
-    }
+static inline int cell_hash_slot(cellhash *h, int64_t key) {
+  /* first slot to look for key in: multiplicative hashing, which spreads
+   * the keys of neighbouring cells over the table */
+  uint64_t k = (uint64_t)key * 0x9e3779b97f4a7c15ull;
+  return ((int)(k >> 32) & (h->size - 1));
+}
 
-    if (bottom != -1) {
-      neighs[*nneighs] = cell_get_ind_from_ij(i, bottom);
-      *nneighs += 1;
-    }
+void cell_hash_init(cellhash *h, int n) {
+  /* ------------------------------------------------
+   * Allocate an empty hash table h for up to n
+   * entries.
+   * ------------------------------------------------ */
 
-    if (top != -1) {
-      neighs[*nneighs] = cell_get_ind_from_ij(i, top);
-      *nneighs += 1;
-    }
+  h->size = 2;
+  while (h->size < 2 * n) {
+    h->size *= 2;
+  }
+  h->n = 0;
+  h->key = malloc(h->size * sizeof(int64_t));
+  h->val = malloc(h->size * sizeof(int));
+  if (h->key == NULL || h->val == NULL) {
+    throw_error("Couldn't allocate cell hash table with %d slots", h->size);
+  }
+  for (int s = 0; s < h->size; s++) {
+    h->val[s] = -1;
+  }
+}
 
-    if (right != -1) {
+void cell_hash_destroy(cellhash *h) {
+  /* ------------------------------------------------
+   * Deallocate hash table h.
+   * ------------------------------------------------ */
 
-      neighs[*nneighs] = cell_get_ind_from_ij(right, j);
-      *nneighs += 1;
+  free(h->key);
+  free(h->val);
+  h->key = NULL;
+  h->val = NULL;
+  h->size = 0;
+  h->n = 0;
+}
 
-      if (bottom != -1) {
-        neighs[*nneighs] = cell_get_ind_from_ij(right, bottom);
-        *nneighs += 1;
-      }
+int cell_hash_find(cellhash *h, int i, int j) {
+  /* ------------------------------------------------
+   * Get the value stored for the cell with indices
+   * i, j in hash table h, or -1 if there is none.
+   * ------------------------------------------------ */
 
-      if (top != -1) {
-        neighs[*nneighs] = cell_get_ind_from_ij(right, top);
-        *nneighs += 1;
-      }
-    }
+  int64_t key = cell_hash_key(i, j);
+  int s = cell_hash_slot(h, key);
+  while (h->val[s] >= 0) {
+    if (h->key[s] == key)
+      return (h->val[s]);
+    s = (s + 1) & (h->size - 1);
   }
-
-#endif
+  return (-1);
 }
 
-int cell_get_ind_from_ij(int i, int j) {
-  /* --------------------------------------------
-   * Compute cell index in grid from given i, j
-   * -------------------------------------------- */
+int cell_hash_insert(cellhash *h, int i, int j, int val) {
+  /* ------------------------------------------------
+   * Store val (>= 0) for the cell with indices i, j
+   * in hash table h, unless there is a value for it
+   * already.
+   * Returns the value stored for the cell.
+   * ------------------------------------------------ */
 
-  return (j * pars.nx + i);
+  int64_t key = cell_hash_key(i, j);
+  int s = cell_hash_slot(h, key);
+  while (h->val[s] >= 0) {
+    if (h->key[s] == key)
+      return (h->val[s]);
+    s = (s + 1) & (h->size - 1);
+  }
+
+  if (2 * (h->n + 1) > h->size) {
+    throw_error("Cell hash table with %d slots is full", h->size);
+  }
+  h->key[s] = key;
+  h->val[s] = val;
+  h->n += 1;
+  return (val);
 }
 
-void cell_get_ij(cell *c, int *i, int *j) {
+void cell_hash_get_ij(cellhash *h, int slot, int *i, int *j) {
   /* ------------------------------------------------
-   * Compute the i and j value of a cell such that
-   * it can be addressed in the grid[] array
+   * Get the indices i, j of the cell in the given
+   * slot of hash table h.
    * ------------------------------------------------ */
 
-#if NDIM == 1
-  *i = c->id;
-  *j = 0;
-#elif NDIM == 2
-  *i = c->id % pars.nx;
-  *j = c->id / pars.nx;
-#endif
+  *i = (int)(uint32_t)(h->key[slot] & 0xffffffff);
+  *j = (int)(h->key[slot] >> 32);
 }
 
 void cell_print_grid_layout() {
@@ -441,7 +1042,11 @@ void cell_print_grid_layout() {
 #if NDIM == 1
   printf("|");
   for (int i = 0; i < pars.nx; i++) {
-    printf("%3d |", grid[i].id);
+    int c = cell_get_ind_from_ij(i, 0);
+    if (c >= 0)
+      printf("%3d |", grid[c].id);
+    else
+      printf("    |"); /* empty cell of the sparse grid */
   }
   printf("\n");
 #elif NDIM == 2
@@ -454,7 +1059,11 @@ void cell_print_grid_layout() {
 
     printf("|");
     for (int i = 0; i < pars.nx; i++) {
-      printf("%3d |", grid[cell_get_ind_from_ij(i, j)].id);
+      int c = cell_get_ind_from_ij(i, j);
+      if (c >= 0)
+        printf("%3d |", grid[c].id);
+      else
+        printf("    |"); /* empty cell of the sparse grid */
     }
     printf("\n");
   }
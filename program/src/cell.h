@@ -9,6 +9,17 @@
 #include "defines.h"
 #include "gas.h"
 
+#include <stdint.h>
+
+/* number of axes the particles of every cell are sorted along: the
+ * directions between a cell and its neighbour cells, up to the sign. In 2D
+ * these are x, y, and the two diagonals x + y and x - y. */
+#if NDIM == 1
+#define CELL_NSORT 1
+#elif NDIM == 2
+#define CELL_NSORT 4
+#endif
+
 typedef struct {
 
   int id;
@@ -16,24 +27,74 @@ typedef struct {
   float x; /* cell center coordinates */
   float y; /* cell center coordinates */
 
-  int npic;         /* number of particles in this cell */
-  int *cellparts;   /* array particles in this cell */
-  int cellpartsize; /* total cellparts array size, how many elements fit in */
+  int npic;   /* number of particles in this cell */
+  int offset; /* index of first particle of this cell in the (cell-ordered)
+                 particle store. Particles of this cell have indices
+                 offset to offset + npic - 1 */
+  int pad;    /* index of this cell in the padded grid, see cell_lookup */
+  int hoffset; /* index of the first entry of this cell's halo in the halo
+                  cache, see cell_build_halos() */
+  int nhalo;   /* number of entries in this cell's halo */
+
+  float *sortd; /* projections of the particles of this cell onto every sort
+                   axis, in ascending order: sortd[a * npic + k] is the k-th
+                   projection along axis a. See cell_sort_particles() */
+  int *sorti;   /* indices of the particles in the same order as sortd */
+
+  /* image cells only, see boundary_init_cells() */
+  int src;        /* cell of the box this cell is an image of; -1 if none */
+  float flip[2];  /* positions x of src map to flip * x + shift here */
+  float shift[2];
 
 } cell;
 
+/* neighbour candidates of every cell of the box, packed: the particles of
+ * the cell and its direct neighbours, image particles included, with
+ * their positions. Cell c has the nhalo entries starting at hoffset. */
+typedef struct {
+  int *ind; /* particle indices */
+  float *x; /* x coordinates */
+  float *y; /* y coordinates */
+  int n;    /* total number of entries */
+} cellhalo;
+
+/* hash table of cells, for the sparse grid (CELL_GRID_SPARSE): maps the
+ * indices i, j of a cell, which lie outside of [0, nx) for image cells, to
+ * a value, usually the index of the cell in grid[]. Open addressing with
+ * linear probing, kept at most half full. */
+typedef struct {
+  int64_t *key; /* i and j of the cell in every slot, packed */
+  int *val;     /* value stored in every slot; -1 for empty slots */
+  int size;     /* number of slots, a power of 2 */
+  int n;        /* number of used slots */
+} cellhash;
+
 void cell_init_cell(cell *c);
-void cell_destroy_cell(cell *c);
 
 void cell_build_grid(); /* this one actually builds grid and calls init_grid */
+int cell_get_grid_size();
+int cell_grid_size_is_valid(int nx, int *count);
 void cell_init_grid();
 void cell_destroy_grid();
+void cell_get_order(int *order);
+int cell_morton_key(int i, int j);
+int cell_hilbert_key(int n, int i, int j);
 
 void cell_distribute_particles();
-void cell_add_particle(cell *c, int pind);
+void cell_sort_particles();
+void cell_build_halos();
+int cell_get_pair_axis(cell *A, cell *B, int *axis);
 
 void cell_get_neighbours(cell *c, int neighs[9], int *nneighs);
+void cell_get_neighbours_within(cell *c, int m, int *neighs, int *nneighs);
 int cell_get_ind_from_ij(int i, int j);
+int cell_compare_keys(const void *a, const void *b);
+
+void cell_hash_init(cellhash *h, int n);
+void cell_hash_destroy(cellhash *h);
+int cell_hash_find(cellhash *h, int i, int j);
+int cell_hash_insert(cellhash *h, int i, int j, int val);
+void cell_hash_get_ij(cellhash *h, int slot, int *i, int *j);
 void cell_get_ij(cell *c, int *i, int *j);
 
 void cell_print_grid_layout();
@@ -14,6 +14,80 @@
  * Riemann solver */
 #define HLLC_USE_ADAPTIVE_SPEED_ESTIMATE
 
+/* whether to keep Verlet neighbour lists: store all neighbours within
+ * (1 + VERLET_SKIN) * H and re-use the lists instead of doing a new
+ * neighbour search until particles moved more than half the skin */
+// #define WITH_VERLET_LISTS
+#define VERLET_SKIN 0.2
+
+/* whether to store every interacting pair of particles only once, as (i, j)
+ * with i < j, instead of a neighbour list per particle in which every pair
+ * shows up twice. Interaction loops go over the pairs and update both
+ * particles at once. With PAIR_LIST_STORE_KERNELS, the kernel values and
+ * derivatives at both h_i and h_j are stored with every pair as well.
+ * Doesn't work with WITH_VERLET_LISTS yet. */
+// #define WITH_PAIR_LISTS
+// #define PAIR_LIST_STORE_KERNELS
+
+/* whether to keep no neighbour lists at all: every interaction is computed
+ * right where the neighbours are found, from the candidates of the cell
+ * grid or tree, and is found again whenever it's needed. Saves the memory
+ * of the lists for the cost of repeating the search. Doesn't work with
+ * WITH_VERLET_LISTS or WITH_PAIR_LISTS. */
+// #define WITHOUT_NEIGHBOUR_LISTS
+
+/* pad every particle's neighbour list to a multiple of NEIGH_LIST_PAD
+ * entries, so that all lists start at offsets that are a multiple of the
+ * SIMD width. 1: no padding */
+#define NEIGH_LIST_PAD 1
+
+/* whether to store the neighbour lists compressed: the indices of every
+ * list sorted and as differences to the previous one in as few bytes as
+ * they need, which is mostly one once particles are sorted into cells, and
+ * the distances as 16 bit integers in units of the largest distance in the
+ * list. part_get_neighbours() decodes them. NEIGH_LIST_PAD doesn't apply
+ * to the compressed lists. Pair lists are stored as they are. */
+// #define NEIGH_LIST_COMPRESSED
+
+/* whether to evaluate the kernel by interpolating in tables of w(q) and
+ * dw/dq with KERNEL_TABLE_SIZE intervals on q = r/H in [0, 1] instead of
+ * analytically. Interpolation: KERNEL_INTERP_LINEAR or KERNEL_INTERP_CUBIC */
+// #define KERNEL_TABULATED
+#define KERNEL_TABLE_SIZE 1024
+#define KERNEL_TABLE_INTERP KERNEL_INTERP_LINEAR
+
+/* number of particles of a cell (or tree leaf) whose smoothing lengths are
+ * iterated together, one per SIMD lane. They share the neighbour candidates,
+ * so the kernel sums for all of them are done in one pass. 1: one particle
+ * at a time */
+#define H_BATCH_SIZE 8
+
+/* candidates further than H_FILTER_FACT * H from all particles of a batch
+ * are dropped before iterating their smoothing lengths. If H grows beyond
+ * that, the candidates are filtered again */
+#define H_FILTER_FACT 1.25
+
+/* how to compute smoothing lengths with the cell grid (NGB_GRID):
+ * H_SOLVE_BATCH:  gather the candidates of every cell and iterate its
+ *                 particles in batches of H_BATCH_SIZE. In 1D, iterate
+ *                 every particle over the window of particles around it
+ *                 in x order instead
+ * H_SOLVE_SWEEPS: symmetric density sweeps over all pairs of neighbouring
+ *                 cells, then repeat the density loop only for the particles
+ *                 that haven't converged yet */
+#define H_SOLVER H_SOLVE_BATCH
+
+/* order in which the grid cells, and with them the particles, are laid out
+ * in memory and traversed (2D only). Choices: SFC_NONE (row major),
+ * SFC_MORTON, SFC_HILBERT */
+#define CELL_ORDER SFC_NONE
+
+/* whether to store only the cells of the grid that contain particles, found
+ * by their indices i, j in a hash table, instead of all nx^2 cells. Then only
+ * occupied cells need enough particles around them, so setups with large
+ * empty regions get cells as small as their particles allow. 2D only */
+// #define CELL_GRID_SPARSE
+
 /* Physical constants */
 
 #define GAMMA (5. / 3.)
@@ -55,18 +129,28 @@
 #define SMALLU 0.
 #define SMALLP 0.
 
-/* assumption for number of particles per cell */
-#define PARTS_ARRAY_SIZE 100
-
 /* for grid building: require that every cell has at lest
  * CELL_MIN_PARTS_IN_NEIGHBOURHOOD_FACT * nngb particles
  * within all the neighbours combined */
 #define CELL_MIN_PARTS_IN_NEIGHBOURHOOD_FACT 2.
 
+/* for tree building: split tree nodes until every leaf contains at most
+ * TREE_LEAF_SIZE_FACT * nngb particles */
+#define TREE_LEAF_SIZE_FACT 1.
+/* max tree depth, in case many particles sit on top of each other */
+#define TREE_MAX_DEPTH 30
+
 /* ----------------------------------------------------------------------------------
  * * Nobody should be changing things below this line
  * ----------------------------------------------------------------------------------*/
 
+/* search radius for neighbours in units of compact support radius H */
+#ifdef WITH_VERLET_LISTS
+#define NEIGHBOUR_SEARCH_FACT (1. + VERLET_SKIN)
+#else
+#define NEIGHBOUR_SEARCH_FACT 1.
+#endif
+
 /* Compute gamma related constants */
 
 static const float GM1 = GAMMA - 1.;
@@ -103,10 +187,32 @@ static const float BETA = 0.5 * (GAMMA - 1.) / GAMMA;
 #define CUBIC_SPLINE 11
 #define QUARTIC_SPLINE 12
 #define QUINTIC_SPLINE 13
-#define WENDLAND_C4 21
-#define WENDLAND_C5 22
+#define WENDLAND_C2 21
+#define WENDLAND_C4 22
 #define WENDLAND_C6 23
 
+/* define kernel table interpolation methods as integers */
+#define KERNEL_INTERP_LINEAR 1
+#define KERNEL_INTERP_CUBIC 3
+
+/* define neighbour search methods as integers */
+#define NGB_GRID 1
+#define NGB_TREE 2
+
+/* define grid smoothing length solvers as integers */
+#define H_SOLVE_BATCH 1
+#define H_SOLVE_SWEEPS 2
+
+/* define space filling curves as integers */
+#define SFC_NONE 0
+#define SFC_MORTON 1
+#define SFC_HILBERT 2
+
+/* define boundary conditions as integers, as given in the parameter file */
+#define BOUNDARY_PERIODIC 0
+#define BOUNDARY_TRANSMISSIVE 1
+#define BOUNDARY_REFLECTIVE 2
+
 /* define sources as integers */
 #define SRC_CONST 1
 #define SRC_RADIAL 2
@@ -18,7 +18,7 @@
 
 extern cell *grid;
 extern params pars;
-extern part *particles;
+extern partstore particles;
 
 void io_read_cmdlineargs(int argc, char *argv[]) {
   /*--------------------------------------------------------
@@ -110,15 +110,13 @@ void io_read_ic() {
     check_number_of_columns_IC(tempbuff, 4);
     sscanf(tempbuff, "%f %f %f %f\n", &x, &m, &u, &p);
 
-    particles[i].m = m;
-    particles[i].x[0] = x;
-    particles[i].x[1] = 0.;
-    particles[i].v[0] = u;
-    particles[i].v[1] = 0.;
+    particles.m[i] = m;
+    particles.x[0][i] = x;
+    particles.x[1][i] = 0.;
 
-    particles[i].prim.u[0] = u;
-    particles[i].prim.u[1] = 0.;
-    particles[i].prim.p = p;
+    particles.cold[i].prim.u[0] = u;
+    particles.cold[i].prim.u[1] = 0.;
+    particles.cold[i].prim.p = p;
 
     i += 1;
 
@@ -127,15 +125,13 @@ void io_read_ic() {
     check_number_of_columns_IC(tempbuff, 6);
     sscanf(tempbuff, "%f %f %f %f %f %f\n", &x, &y, &m, &u, &v, &p);
 
-    particles[i].x[0] = x;
-    particles[i].x[1] = y;
-    particles[i].m = m;
-    particles[i].v[0] = u;
-    particles[i].v[1] = v;
+    particles.x[0][i] = x;
+    particles.x[1][i] = y;
+    particles.m[i] = m;
 
-    particles[i].prim.u[0] = u;
-    particles[i].prim.u[1] = v;
-    particles[i].prim.p = p;
+    particles.cold[i].prim.u[0] = u;
+    particles.cold[i].prim.u[1] = v;
+    particles.cold[i].prim.p = p;
 
     i += 1;
 #endif
@@ -344,13 +340,19 @@ void io_write_output(int *outstep, int step, float t) {
   fprintf(outfilep, "# t = %12.6lf\n", t);
   fprintf(outfilep, "# nsteps = %12d\n", step);
 
+  /* particles may be re-ordered in memory. Write them in order of their IDs */
+  int *order = malloc(pars.npart * sizeof(int));
+  part_get_id_order(order);
+
 #if NDIM == 1
   fprintf(outfilep, "#%11s %12s %12s %12s %12s %12s\n", "x", "m", "rho", "u",
           "p", "h");
   for (int i = 0; i < pars.npart; i++) {
-    part p = particles[i];
-    fprintf(outfilep, "%12.6e %12.6e %12.6e %12.6e %12.6e %12.6e\n", p.x[0],
-            p.m, p.prim.rho, p.prim.u[0], p.prim.p, p.h);
+    int P = order[i];
+    pstate *prim = &particles.cold[P].prim;
+    fprintf(outfilep, "%12.6e %12.6e %12.6e %12.6e %12.6e %12.6e\n",
+            particles.x[0][P], particles.m[P], prim->rho, prim->u[0],
+            prim->p, particles.h[P]);
   }
 
 #elif NDIM == 2
@@ -358,13 +360,16 @@ void io_write_output(int *outstep, int step, float t) {
   fprintf(outfilep, "# %12s %12s %12s %12s %12s %12s %12s %12s\n", "x", "y",
           "m", "rho", "u_x", "u_y", "p", "h");
   for (int i = 0; i < pars.npart; i++) {
-    part p = particles[i];
+    int P = order[i];
+    pstate *prim = &particles.cold[P].prim;
     fprintf(outfilep,
-            "%12.6e %12.6e %12.6e %12.6e %12.6e %12.6e %12.6e %12.6e\n", p.x[0],
-            p.x[1], p.m, p.prim.rho, p.prim.u[0], p.prim.u[1], p.prim.p, p.h);
+            "%12.6e %12.6e %12.6e %12.6e %12.6e %12.6e %12.6e %12.6e\n",
+            particles.x[0][P], particles.x[1][P], particles.m[P], prim->rho,
+            prim->u[0], prim->u[1], prim->p, particles.h[P]);
   }
 
 #endif
+  free(order);
   fclose(outfilep);
 
   /* raise output step number */
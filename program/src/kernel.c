@@ -4,6 +4,16 @@
  * mladen.ivkovic@hotmail.com           */
 
 #include "kernel.h"
+#include "utils.h"
+
+#ifdef KERNEL_TABULATED
+/* kernel tables: entry i + 1 holds the value at q = i / KERNEL_TABLE_SIZE
+ * for i = -1, ..., KERNEL_TABLE_SIZE + 1. The outermost entries are only
+ * there so that cubic interpolation doesn't need to special-case the
+ * first and last interval. */
+static float kernel_w_table[KERNEL_TABLE_SIZE + 3];
+static float kernel_dwdq_table[KERNEL_TABLE_SIZE + 3];
+#endif
 
 float kernel_Hfromh(float h) {
   /* -----------------------------------
@@ -20,3 +30,95 @@ float kernel_hfromH(float H) {
    * ----------------------------------- */
   return (H / KERNEL_Hoverh);
 }
+
+float kernel_W(float r, float h) {
+  /* ---------------------------------------
+   * Evaluate kernel value at given distance
+   * r for given smoothing length h
+   * --------------------------------------- */
+
+  float H = h * KERNEL_Hoverh;
+  return (kernel_norm(H) * kernel_w(r / H));
+}
+
+float kernel_dWdr(float r, float h) {
+  /* ---------------------------------------
+   * Evaluate first kernel derivative at
+   * given distance r for given smoothing
+   * length h
+   * --------------------------------------- */
+
+  float H = h * KERNEL_Hoverh;
+  /* additional 1/H: dw/dr = dw/dq dq/dr = dw/dq 1/H */
+  return (kernel_norm(H) / H * kernel_dwdq(r / H));
+}
+
+#ifdef KERNEL_TABULATED
+
+void kernel_init_table() {
+  /* ---------------------------------------
+   * Fill up the kernel tables from the
+   * analytic kernel.
+   * --------------------------------------- */
+
+  log_extra("Tabulating kernel with %d intervals", KERNEL_TABLE_SIZE);
+
+  float dq = 1. / (float)KERNEL_TABLE_SIZE;
+
+  for (int i = 0; i <= KERNEL_TABLE_SIZE; i++) {
+    kernel_w_dwdq_analytic(i * dq, &kernel_w_table[i + 1],
+                           &kernel_dwdq_table[i + 1]);
+  }
+
+  /* the kernel is symmetric around q = 0, and vanishes beyond q = 1 */
+  kernel_w_table[0] = kernel_w_table[2];
+  kernel_dwdq_table[0] = -kernel_dwdq_table[2];
+  kernel_w_table[KERNEL_TABLE_SIZE + 2] = 0.;
+  kernel_dwdq_table[KERNEL_TABLE_SIZE + 2] = 0.;
+}
+
+float kernel_interpolate(const float *table, float q) {
+  /* ---------------------------------------
+   * Interpolate given kernel table at
+   * q = r/H. Returns 0 for q >= 1.
+   * --------------------------------------- */
+
+  if (q >= 1.)
+    return (0.);
+
+  float x = q * KERNEL_TABLE_SIZE;
+  int i = (int)x;
+  float t = x - i;
+  const float *p = table + i; /* p[1] is the value at the left node */
+
+#if KERNEL_TABLE_INTERP == KERNEL_INTERP_LINEAR
+  return (p[1] + t * (p[2] - p[1]));
+#elif KERNEL_TABLE_INTERP == KERNEL_INTERP_CUBIC
+  /* Catmull-Rom spline through the four surrounding nodes */
+  float a = -p[0] + 3. * p[1] - 3. * p[2] + p[3];
+  float b = 2. * p[0] - 5. * p[1] + 4. * p[2] - p[3];
+  float c = -p[0] + p[2];
+  return (p[1] + 0.5 * t * (c + t * (b + t * a)));
+#endif
+}
+
+float kernel_w(float q) {
+  /* ---------------------------------------
+   * Evaluate the dimensionless kernel shape
+   * at q = r/H from the table
+   * --------------------------------------- */
+
+  return (kernel_interpolate(kernel_w_table, q));
+}
+
+float kernel_dwdq(float q) {
+  /* ---------------------------------------
+   * Evaluate the derivative of the
+   * dimensionless kernel shape at q = r/H
+   * from the table
+   * --------------------------------------- */
+
+  return (kernel_interpolate(kernel_dwdq_table, q));
+}
+
+#endif
@@ -20,4 +20,26 @@
 
 #endif
 
+static inline void kernel_w_dwdq_analytic(float q, float *w, float *dwdq) {
+  /* ---------------------------------------
+   * Evaluate the dimensionless kernel shape
+   * w(q) and its derivative dw/dq at
+   * q = r/H together, without normalisation.
+   * Branch-free: the pieces are clamped at
+   * zero instead of tested, so that loops
+   * calling this vectorise.
+   * --------------------------------------- */
+
+  float t1 = 1.f - q;
+  float t2 = 0.5f - q;
+  t1 = t1 > 0.f ? t1 : 0.f;
+  t2 = t2 > 0.f ? t2 : 0.f;
+
+  float t1sq = t1 * t1;
+  float t2sq = t2 * t2;
+
+  *w = t1sq * t1 - 4.f * t2sq * t2;
+  *dwdq = -3.f * t1sq + 12.f * t2sq;
+}
+
 #endif
@@ -8,7 +8,7 @@
 
 #if NDIM == 1
 
-// 5^5 / 786
+// 5^5 / 768
 #define KERNEL_NORM 4.069010
 #define KERNEL_Hoverh 1.936492
 
@@ -20,4 +20,28 @@
 
 #endif
 
+static inline void kernel_w_dwdq_analytic(float q, float *w, float *dwdq) {
+  /* ---------------------------------------
+   * Evaluate the dimensionless kernel shape
+   * w(q) and its derivative dw/dq at
+   * q = r/H together, without normalisation.
+   * Branch-free: the pieces are clamped at
+   * zero instead of tested.
+   * --------------------------------------- */
+
+  float t1 = 1.f - q;
+  float t2 = 0.6f - q;
+  float t3 = 0.2f - q;
+  t1 = t1 > 0.f ? t1 : 0.f;
+  t2 = t2 > 0.f ? t2 : 0.f;
+  t3 = t3 > 0.f ? t3 : 0.f;
+
+  float t1cb = t1 * t1 * t1;
+  float t2cb = t2 * t2 * t2;
+  float t3cb = t3 * t3 * t3;
+
+  *w = t1cb * t1 - 5.f * t2cb * t2 + 10.f * t3cb * t3;
+  *dwdq = -4.f * t1cb + 20.f * t2cb - 40.f * t3cb;
+}
+
 #endif
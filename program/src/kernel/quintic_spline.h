@@ -20,4 +20,31 @@
 
 #endif
 
+static inline void kernel_w_dwdq_analytic(float q, float *w, float *dwdq) {
+  /* ---------------------------------------
+   * Evaluate the dimensionless kernel shape
+   * w(q) and its derivative dw/dq at
+   * q = r/H together, without normalisation.
+   * Branch-free: the pieces are clamped at
+   * zero instead of tested.
+   * --------------------------------------- */
+
+  float t1 = 1.f - q;
+  float t2 = 2.f / 3.f - q;
+  float t3 = 1.f / 3.f - q;
+  t1 = t1 > 0.f ? t1 : 0.f;
+  t2 = t2 > 0.f ? t2 : 0.f;
+  t3 = t3 > 0.f ? t3 : 0.f;
+
+  float t1sq = t1 * t1;
+  float t2sq = t2 * t2;
+  float t3sq = t3 * t3;
+  float t1qd = t1sq * t1sq;
+  float t2qd = t2sq * t2sq;
+  float t3qd = t3sq * t3sq;
+
+  *w = t1qd * t1 - 6.f * t2qd * t2 + 15.f * t3qd * t3;
+  *dwdq = -5.f * t1qd + 30.f * t2qd - 75.f * t3qd;
+}
+
 #endif
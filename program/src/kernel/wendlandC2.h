@@ -20,4 +20,29 @@
 
 #endif
 
+static inline void kernel_w_dwdq_analytic(float q, float *w, float *dwdq) {
+  /* ---------------------------------------
+   * Evaluate the dimensionless kernel shape
+   * w(q) and its derivative dw/dq at
+   * q = r/H together, without normalisation.
+   * Branch-free: (1 - q) is clamped at zero
+   * instead of tested.
+   * --------------------------------------- */
+
+  float t = 1.f - q;
+  t = t > 0.f ? t : 0.f;
+  float tsq = t * t;
+
+#if NDIM == 1
+  /* w = (1 - q)^3 (1 + 3q) */
+  *w = tsq * t * (1.f + 3.f * q);
+  *dwdq = -12.f * q * tsq;
+#elif NDIM == 2
+  /* w = (1 - q)^4 (1 + 4q) */
+  float tcb = tsq * t;
+  *w = tcb * t * (1.f + 4.f * q);
+  *dwdq = -20.f * q * tcb;
+#endif
+}
+
 #endif
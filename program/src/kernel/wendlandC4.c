@@ -1,30 +0,0 @@
-/* Wendland C4 Kernel */
-
-/* Written by Mladen Ivkovic, JUN 2020
- * mladen.ivkovic@hotmail.com           */
-
-#include "kernel.h"
-#include "utils.h"
-
-#include <math.h>
-
-float kernel_W(float r, float h) {
-  /* ---------------------------------------
-   * Evaluate kernel value at given distance
-   * r for given smoothing length h
-   * --------------------------------------- */
-
-  throw_error("WendlandC4: not implemented yet");
-  return (0.);
-}
-
-float kernel_dWdr(float r, float h) {
-  /* ---------------------------------------
-   * Evaluate first kernel derivative at
-   * given distance r for given smoothing
-   * length h
-   * --------------------------------------- */
-
-  throw_error("WendlandC4: not implemented yet");
-  return (0.);
-}
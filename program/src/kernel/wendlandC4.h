@@ -20,4 +20,30 @@
 
 #endif
 
+static inline void kernel_w_dwdq_analytic(float q, float *w, float *dwdq) {
+  /* ---------------------------------------
+   * Evaluate the dimensionless kernel shape
+   * w(q) and its derivative dw/dq at
+   * q = r/H together, without normalisation.
+   * Branch-free: (1 - q) is clamped at zero
+   * instead of tested.
+   * --------------------------------------- */
+
+  float t = 1.f - q;
+  t = t > 0.f ? t : 0.f;
+  float tsq = t * t;
+  float tqd = tsq * tsq;
+
+#if NDIM == 1
+  /* w = (1 - q)^5 (1 + 5q + 8q^2) */
+  *w = tqd * t * (1.f + q * (5.f + 8.f * q));
+  *dwdq = -14.f * q * (1.f + 4.f * q) * tqd;
+#elif NDIM == 2
+  /* w = (1 - q)^6 (1 + 6q + 35/3 q^2) */
+  float tqn = tqd * t;
+  *w = tqn * t * (1.f + q * (6.f + 35.f / 3.f * q));
+  *dwdq = -56.f / 3.f * q * (1.f + 5.f * q) * tqn;
+#endif
+}
+
 #endif
@@ -20,4 +20,31 @@
 
 #endif
 
+static inline void kernel_w_dwdq_analytic(float q, float *w, float *dwdq) {
+  /* ---------------------------------------
+   * Evaluate the dimensionless kernel shape
+   * w(q) and its derivative dw/dq at
+   * q = r/H together, without normalisation.
+   * Branch-free: (1 - q) is clamped at zero
+   * instead of tested.
+   * --------------------------------------- */
+
+  float t = 1.f - q;
+  t = t > 0.f ? t : 0.f;
+  float tsq = t * t;
+  float tqd = tsq * tsq;
+
+#if NDIM == 1
+  /* w = (1 - q)^7 (1 + 7q + 19q^2 + 21q^3) */
+  float tsx = tqd * tsq;
+  *w = tsx * t * (1.f + q * (7.f + q * (19.f + 21.f * q)));
+  *dwdq = -6.f * q * (3.f + q * (18.f + 35.f * q)) * tsx;
+#elif NDIM == 2
+  /* w = (1 - q)^8 (1 + 8q + 25q^2 + 32q^3) */
+  float tsv = tqd * tsq * t;
+  *w = tsv * t * (1.f + q * (8.f + q * (25.f + 32.f * q)));
+  *dwdq = -22.f * q * (1.f + q * (7.f + 16.f * q)) * tsv;
+#endif
+}
+
 #endif
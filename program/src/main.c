@@ -20,15 +20,25 @@
 #include "params.h"
 #include "particles.h"
 #include "solver.h"
+#include "tree.h"
 #include "utils.h"
 
 /* ------------------ */
 /* Initialize globals */
 /* ------------------ */
 
-params pars;     /* global parameters */
-part *particles; /* particle array */
-cell *grid;      /* particle grid */
+params pars;           /* global parameters */
+partstore particles;   /* particle data */
+cell *grid;            /* particle grid */
+int *cell_order;       /* order in which cells are laid out and traversed */
+int *cell_lookup;      /* cell indices of the grid padded with image cells */
+int *cell_stencil;     /* offsets in cell_lookup to the cells around a cell */
+cellhalo halos;        /* packed neighbour candidates of every cell */
+cellhash cell_table;   /* cells of the sparse grid by their indices */
+treenode *tree;        /* particle tree */
+neighlist nlist;       /* neighbour lists of all particles */
+pairlist plist;        /* interacting pairs of particles */
+part_scratch *scratch; /* per-thread scratch space */
 
 /* ====================================== */
 int main(int argc, char *argv[]) {
@@ -60,16 +70,26 @@ int main(int argc, char *argv[]) {
 
   params_check();        /* check whether we can work with this setup. */
   params_init_derived(); /* process the parameters you got. */
+#ifdef KERNEL_TABULATED
+  kernel_init_table();
+#endif
 
   /* print / announce stuff for logging */
   print_compile_defines();
   params_print_log();
 
-  cell_build_grid();
-  part_get_smoothing_lengths();
+  double ngb_start = wall_time();
+  part_find_neighbours();
+  double ngb_end = wall_time();
+  log_message("Neighbour search and smoothing lengths took %.3fs\n",
+              ngb_end - ngb_start);
   part_write_smoothing_lengths(0);
-  free_part_arrays();  /* TODO: don't forget this! */
+  free_part_arrays(); /* TODO: don't forget this! */
+#if NEIGHBOUR_SEARCH == NGB_TREE
+  tree_destroy(); /* TODO: don't forget this! */
+#else
   cell_destroy_grid(); /* TODO: don't forget this! */
+#endif
 
   /* temporary: to check kernels */
   /* printf("--------------------------------------------------------------\n");
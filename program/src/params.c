@@ -8,6 +8,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include "kernel.h"
 #include "params.h"
 #include "utils.h"
@@ -30,13 +34,19 @@ void params_init_defaults() {
 
   pars.ccfl = 0.9;
   pars.force_dt = 0;
-  pars.boundary = 0;
+  pars.boundary = BOUNDARY_PERIODIC;
   pars.nngb = 0.0;
   pars.eta = 0.0;
 
   pars.nx = pars.npart;
   pars.dx = BOXLEN / pars.npart;
   pars.ncelltot = pars.nx;
+  pars.nimglayers = 0;
+  pars.ncellimg = 0;
+  pars.nimage = 0;
+
+  pars.ntreenodes = 0;
+  pars.ntreenodes_alloc = 0;
 
   /* output related parameters */
   pars.foutput = 0;
@@ -60,6 +70,8 @@ void params_init_defaults() {
   pars.constant_acceleration = 0;
   pars.constant_acceleration_computed = 0;
   pars.sources_are_read = 0;
+
+  pars.nthreads = 1;
 }
 
 void params_init_derived() {
@@ -180,6 +192,12 @@ void params_init_derived() {
 #if (SOURCE == SRC_CONST) || (SOURCE == SRC_RADIAL)
   pars.constant_acceleration = 1;
 #endif
+
+  /* Get number of threads */
+  /* --------------------- */
+#ifdef _OPENMP
+  pars.nthreads = omp_get_max_threads();
+#endif
 }
 
 void params_print_log() {
@@ -206,6 +224,7 @@ void params_print_log() {
   log_message("C_cfl:                       %g\n", pars.ccfl);
   log_message("Nngb:                        %.3f\n", pars.nngb);
   log_message("eta:                         %.3f\n", pars.eta);
+  log_message("threads:                     %d\n", pars.nthreads);
 
   if (pars.force_dt > 0) {
     log_message("Forcing time step size to: %g\n", pars.force_dt);
@@ -213,10 +232,12 @@ void params_print_log() {
 
   log_message("boundary conditions:         ");
   if (pars.verbose > 0) {
-    if (pars.boundary == 0) {
+    if (pars.boundary == BOUNDARY_PERIODIC) {
       printf("periodic\n");
-    } else if (pars.boundary == 1) {
+    } else if (pars.boundary == BOUNDARY_TRANSMISSIVE) {
       printf("transmissive\n");
+    } else if (pars.boundary == BOUNDARY_REFLECTIVE) {
+      printf("reflective\n");
     }
   }
 
@@ -302,6 +323,37 @@ void params_check() {
     throw_error("In params_check: I have nx = 0 cells for the sim.");
   }
 
+  if (pars.boundary != BOUNDARY_PERIODIC &&
+      pars.boundary != BOUNDARY_TRANSMISSIVE &&
+      pars.boundary != BOUNDARY_REFLECTIVE) {
+    throw_error("Unknown boundary condition %d. Use 0 (periodic), "
+                "1 (transmissive), or 2 (reflective).",
+                pars.boundary);
+  }
+
+#if defined(CELL_GRID_SPARSE) && NDIM == 1
+  throw_error("The sparse cell grid only works in 2D. Undefine "
+              "CELL_GRID_SPARSE.");
+#endif
+
+#if NEIGHBOUR_SEARCH == NGB_TREE
+  if (pars.boundary == BOUNDARY_REFLECTIVE) {
+    throw_error("Reflective boundaries need image particles, which only the "
+                "cell grid provides. Use NEIGHBOUR_SEARCH = GRID.");
+  }
+#endif
+
+#if defined(WITH_PAIR_LISTS) && defined(WITH_VERLET_LISTS)
+  throw_error("Code is compiled with pair lists and Verlet lists, which don't "
+              "work together yet. Pick one.");
+#endif
+
+#if defined(WITHOUT_NEIGHBOUR_LISTS) &&                                        \
+    (defined(WITH_VERLET_LISTS) || defined(WITH_PAIR_LISTS))
+  throw_error("Code is compiled without neighbour lists, but with Verlet or "
+              "pair lists, which need them. Pick one.");
+#endif
+
   /* check source related stuff. */
 #ifdef WITH_SOURCES
   if (!pars.sources_are_read) {
@@ -23,7 +23,8 @@ typedef struct {
   float ccfl;     /* CFL coefficient */
   float force_dt; /* force a time step size (except if you need to write an
                      output) */
-  int boundary;   /* boundary condition for all walls.*/
+  int boundary;   /* boundary condition for all walls: BOUNDARY_PERIODIC,
+                     BOUNDARY_TRANSMISSIVE, or BOUNDARY_REFLECTIVE */
   float nngb;     /* number of neighbours to use */
   float eta;      /* actual resolution, preferable way of defining number of
                      neighbours to use. */
@@ -32,6 +33,16 @@ typedef struct {
   float dx;     /* cell size */
   int ncelltot; /* total number of cells in grid. nx in 1D, nx^2 in 2D. Mainly
                    used to avoid dimension checks */
+  int nimglayers; /* number of layers of image cells around the box */
+  int ncellimg;   /* number of image cells. They are stored in the grid after
+                     the ncelltot cells of the box */
+  int nimage;     /* number of image particles. They are stored after the
+                     npart particles */
+
+  int ntreenodes;       /* number of nodes in the tree */
+  int ntreenodes_alloc; /* number of nodes the tree array has space for */
+
+  int nthreads; /* number of OpenMP threads; 1 without OpenMP */
 
   /* output related parameters */
   int foutput;  /* after how many steps to write output */
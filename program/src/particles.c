@@ -4,251 +4,2634 @@
  * mladen.ivkovic@hotmail.com           */
 
 #include "particles.h"
+#include "boundary.h"
 #include "cell.h"
 #include "defines.h"
 #include "gas.h"
 #include "kernel.h"
 #include "params.h"
 #include "sort.h"
+#include "task.h"
+#include "tree.h"
 #include "utils.h"
 
+#include <float.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 extern params pars;
-extern part *particles;
+extern partstore particles;
 extern cell *grid;
+extern int *cell_order;
+extern int *cell_lookup;
+extern treenode *tree;
+extern neighlist nlist;
+extern pairlist plist;
+extern part_scratch *scratch;
+extern cellhalo halos;
+
+void init_part_array() {
+  /* --------------------------------------
+   * Initialize particle array
+   * -------------------------------------- */
+
+  log_extra("Initializing particle array");
+
+  if (pars.npart == 0) {
+    throw_error("Can't allocate space for particle array: Have npart = 0");
+  }
+
+  part_alloc_store(&particles, pars.npart);
+
+  for (int p = 0; p < pars.npart; p++) {
+    init_part(p);
+    particles.cold[p].id = p + 1;
+  }
+}
+
+void init_part(int i) {
+  /* ----------------------------------------
+   * Reset all particle values for particle
+   * with index i
+   * DOES NOT RESET PARTICLE ID
+   * ---------------------------------------- */
+
+  particles.x[0][i] = 0.;
+  particles.x[1][i] = 0.;
+  particles.m[i] = 0.;
+  particles.h[i] = 0.;
+  particles.dhdt[i] = 0.;
+  particles.nneigh_iact[i] = 0;
+
+  gas_init_pstate(&(particles.cold[i].prim));
+  gas_init_cstate(&(particles.cold[i].cons));
+
+#ifdef WITH_VERLET_LISTS
+  particles.nneigh_verlet[i] = 0;
+  particles.x_verlet[0][i] = 0.;
+  particles.x_verlet[1][i] = 0.;
+  particles.r_verlet[i] = 0.;
+#endif
+}
+
+void part_alloc_store(partstore *s, int n) {
+  /* ------------------------------------------
+   * Allocate the arrays of particle store s
+   * for n particles. Values are not set.
+   * ------------------------------------------ */
+
+  s->x[0] = part_aligned_malloc(n * sizeof(float));
+  s->x[1] = part_aligned_malloc(n * sizeof(float));
+  s->h = part_aligned_malloc(n * sizeof(float));
+  s->dhdt = part_aligned_malloc(n * sizeof(float));
+  s->m = part_aligned_malloc(n * sizeof(float));
+  s->nneigh_iact = part_aligned_malloc(n * sizeof(int));
+#ifdef WITH_VERLET_LISTS
+  s->nneigh_verlet = part_aligned_malloc(n * sizeof(int));
+  s->x_verlet[0] = part_aligned_malloc(n * sizeof(float));
+  s->x_verlet[1] = part_aligned_malloc(n * sizeof(float));
+  s->r_verlet = part_aligned_malloc(n * sizeof(float));
+#endif
+  s->cold = malloc(n * sizeof(part));
+  if (s->cold == NULL) {
+    throw_error("Couldn't allocate cold particle data for %d particles", n);
+  }
+  s->nalloc = n;
+}
+
+void part_free_store(partstore *s) {
+  /* ------------------------------------------
+   * Deallocate the arrays of particle store s
+   * ------------------------------------------ */
+
+  free(s->x[0]);
+  free(s->x[1]);
+  free(s->h);
+  free(s->dhdt);
+  free(s->m);
+  free(s->nneigh_iact);
+#ifdef WITH_VERLET_LISTS
+  free(s->nneigh_verlet);
+  free(s->x_verlet[0]);
+  free(s->x_verlet[1]);
+  free(s->r_verlet);
+#endif
+  free(s->cold);
+}
+
+void *part_aligned_malloc(size_t size) {
+  /* ------------------------------------------
+   * Allocate size bytes aligned to
+   * PART_ARRAY_ALIGN bytes.
+   * ------------------------------------------ */
+
+  /* aligned_alloc wants size to be a multiple of the alignment */
+  size_t padded =
+      (size + PART_ARRAY_ALIGN - 1) / PART_ARRAY_ALIGN * PART_ARRAY_ALIGN;
+  void *ptr = aligned_alloc(PART_ARRAY_ALIGN, padded);
+  if (ptr == NULL) {
+    throw_error("Couldn't allocate %zu bytes for particle data", padded);
+  }
+  return (ptr);
+}
+
+void part_copy(partstore *dst, int j, partstore *src, int i) {
+  /* ------------------------------------------
+   * Copy particle with index i of store src
+   * to index j of store dst.
+   * ------------------------------------------ */
+
+  dst->x[0][j] = src->x[0][i];
+  dst->x[1][j] = src->x[1][i];
+  dst->h[j] = src->h[i];
+  dst->dhdt[j] = src->dhdt[i];
+  dst->m[j] = src->m[i];
+  dst->nneigh_iact[j] = src->nneigh_iact[i];
+#ifdef WITH_VERLET_LISTS
+  dst->nneigh_verlet[j] = src->nneigh_verlet[i];
+  dst->x_verlet[0][j] = src->x_verlet[0][i];
+  dst->x_verlet[1][j] = src->x_verlet[1][i];
+  dst->r_verlet[j] = src->r_verlet[i];
+#endif
+  dst->cold[j] = src->cold[i];
+}
+
+void part_swap(int i, int j) {
+  /* ------------------------------------------
+   * Swap particles with indices i and j of
+   * the global particle store.
+   * ------------------------------------------ */
+
+  float tempf;
+  int tempi;
+
+  tempf = particles.x[0][i];
+  particles.x[0][i] = particles.x[0][j];
+  particles.x[0][j] = tempf;
+  tempf = particles.x[1][i];
+  particles.x[1][i] = particles.x[1][j];
+  particles.x[1][j] = tempf;
+  tempf = particles.h[i];
+  particles.h[i] = particles.h[j];
+  particles.h[j] = tempf;
+  tempf = particles.dhdt[i];
+  particles.dhdt[i] = particles.dhdt[j];
+  particles.dhdt[j] = tempf;
+  tempf = particles.m[i];
+  particles.m[i] = particles.m[j];
+  particles.m[j] = tempf;
+  tempi = particles.nneigh_iact[i];
+  particles.nneigh_iact[i] = particles.nneigh_iact[j];
+  particles.nneigh_iact[j] = tempi;
+#ifdef WITH_VERLET_LISTS
+  tempi = particles.nneigh_verlet[i];
+  particles.nneigh_verlet[i] = particles.nneigh_verlet[j];
+  particles.nneigh_verlet[j] = tempi;
+  tempf = particles.x_verlet[0][i];
+  particles.x_verlet[0][i] = particles.x_verlet[0][j];
+  particles.x_verlet[0][j] = tempf;
+  tempf = particles.x_verlet[1][i];
+  particles.x_verlet[1][i] = particles.x_verlet[1][j];
+  particles.x_verlet[1][j] = tempf;
+  tempf = particles.r_verlet[i];
+  particles.r_verlet[i] = particles.r_verlet[j];
+  particles.r_verlet[j] = tempf;
+#endif
+
+  part temp = particles.cold[i];
+  particles.cold[i] = particles.cold[j];
+  particles.cold[j] = temp;
+}
+
+void free_part_arrays() {
+  /*----------------------------------
+   * Deallocate arrays that belong to
+   * the particles
+   * --------------------------------- */
+
+  free(nlist.offset);
+  free(nlist.owner);
+  free(nlist.neigh);
+  free(nlist.r);
+  nlist.offset = NULL;
+  nlist.owner = NULL;
+  nlist.neigh = NULL;
+  nlist.r = NULL;
+  nlist.nused = 0;
+  nlist.nalloc = 0;
+#ifdef NEIGH_LIST_COMPRESSED
+  free(nlist.coffset);
+  free(nlist.rscale);
+  free(nlist.code);
+  free(nlist.rq);
+  nlist.coffset = NULL;
+  nlist.rscale = NULL;
+  nlist.code = NULL;
+  nlist.rq = NULL;
+  nlist.ncalloc = 0;
+#endif
+
+  free(plist.i);
+  free(plist.j);
+  free(plist.r);
+#ifdef PAIR_LIST_STORE_KERNELS
+  free(plist.Wi);
+  free(plist.Wj);
+  free(plist.dWdri);
+  free(plist.dWdrj);
+  plist.Wi = NULL;
+  plist.Wj = NULL;
+  plist.dWdri = NULL;
+  plist.dWdrj = NULL;
+#endif
+  plist.i = NULL;
+  plist.j = NULL;
+  plist.r = NULL;
+  plist.npairs = 0;
+  plist.nalloc = 0;
+
+  if (scratch != NULL) {
+    for (int t = 0; t < pars.nthreads; t++) {
+      part_scratch *s = &scratch[t];
+      free(s->allneighs);
+      free(s->neighs_p);
+      free(s->r);
+      free(s->x);
+      free(s->y);
+      free(s->rbatch);
+      free(s->rkept);
+      free(s->list.neigh);
+      free(s->list.r);
+    }
+    free(scratch);
+    scratch = NULL;
+  }
+}
+
+void part_init_neighbour_list() {
+  /* -------------------------------------------------------
+   * Allocate the global neighbour list and the scratch
+   * space of every thread. The scratch neighbour lists
+   * get a first guess for their size; they are grown as
+   * needed. The global neighbour arrays are allocated
+   * when the scratch lists are first gathered. All of it
+   * is kept around between neighbour searches.
+   * Without neighbour lists, only the scratch candidate
+   * arrays are needed.
+   * ------------------------------------------------------- */
+
+  log_extra("Initializing neighbour list");
+
+  nlist.offset = NULL;
+  nlist.owner = NULL;
+  nlist.neigh = NULL;
+  nlist.r = NULL;
+  nlist.nused = 0;
+  nlist.nalloc = 0;
+
+#ifndef WITHOUT_NEIGHBOUR_LISTS
+  int nguess = (int)(2. * NEIGHBOUR_SEARCH_FACT * pars.nngb) + NEIGH_LIST_PAD;
+
+  nlist.offset = malloc(pars.npart * sizeof(int));
+  nlist.owner = malloc(pars.npart * sizeof(int));
+  if (nlist.offset == NULL || nlist.owner == NULL) {
+    throw_error("Couldn't allocate neighbour list offsets");
+  }
+#ifdef NEIGH_LIST_COMPRESSED
+  nlist.coffset = malloc(pars.npart * sizeof(int));
+  nlist.rscale = malloc(pars.npart * sizeof(float));
+  nlist.code = NULL;
+  nlist.rq = NULL;
+  nlist.ncalloc = 0;
+  if (nlist.coffset == NULL || nlist.rscale == NULL) {
+    throw_error("Couldn't allocate compressed neighbour list offsets");
+  }
+#endif
+#endif
+
+  scratch = malloc(pars.nthreads * sizeof(part_scratch));
+  for (int t = 0; t < pars.nthreads; t++) {
+    part_scratch *s = &scratch[t];
+    s->ncand_alloc = 0;
+    s->allneighs = NULL;
+    s->neighs_p = NULL;
+    s->r = NULL;
+    s->x = NULL;
+    s->y = NULL;
+    s->rbatch = NULL;
+    s->rkept = NULL;
+    s->list.offset = NULL;
+    s->list.owner = NULL;
+    s->list.nused = 0;
+    s->list.nalloc = 0;
+    s->list.neigh = NULL;
+    s->list.r = NULL;
+#ifndef WITHOUT_NEIGHBOUR_LISTS
+    s->list.nalloc = (pars.npart / pars.nthreads + 1) * nguess;
+    s->list.neigh = malloc(s->list.nalloc * sizeof(int));
+    s->list.r = malloc(s->list.nalloc * sizeof(float));
+    if (s->list.neigh == NULL || s->list.r == NULL) {
+      throw_error("Couldn't allocate scratch neighbour list with %d entries",
+                  s->list.nalloc);
+    }
+#endif
+  }
+}
+
+void part_scratch_reserve(part_scratch *s, int n) {
+  /* -------------------------------------------------------
+   * Make sure the candidate arrays of scratch space s have
+   * room for at least n neighbour candidates. They only
+   * ever grow, so they end up sized to the largest
+   * neighbourhood the thread has seen.
+   * ------------------------------------------------------- */
+
+  if (n <= s->ncand_alloc)
+    return;
+
+  s->ncand_alloc = n;
+  free(s->allneighs);
+  free(s->neighs_p);
+  free(s->r);
+  free(s->x);
+  free(s->y);
+  free(s->rbatch);
+  free(s->rkept);
+  s->allneighs = malloc(n * sizeof(int));
+  s->neighs_p = malloc(n * sizeof(int));
+  s->r = malloc(n * sizeof(float));
+  s->x = malloc(n * sizeof(float));
+  s->y = malloc(n * sizeof(float));
+  s->rbatch = malloc(n * H_BATCH_SIZE * sizeof(float));
+  s->rkept = malloc(n * H_BATCH_SIZE * sizeof(float));
+  if (s->allneighs == NULL || s->neighs_p == NULL || s->r == NULL ||
+      s->x == NULL || s->y == NULL || s->rbatch == NULL || s->rkept == NULL) {
+    throw_error("Couldn't allocate scratch space for %d candidates", n);
+  }
+}
+
+int part_reserve_neighbours(neighlist *list, int n) {
+  /* -------------------------------------------------------
+   * Reserve space for n (padded to a multiple of
+   * NEIGH_LIST_PAD) entries in the neighbour list, growing
+   * it if necessary. Returns the offset of the first
+   * reserved entry.
+   * ------------------------------------------------------- */
+
+  int npad = ((n + NEIGH_LIST_PAD - 1) / NEIGH_LIST_PAD) * NEIGH_LIST_PAD;
+
+  if (list->nused + npad > list->nalloc) {
+    while (list->nused + npad > list->nalloc) {
+      list->nalloc *= 2;
+    }
+    debugmessage("Growing neighbour list to %d entries", list->nalloc);
+    list->neigh = realloc(list->neigh, list->nalloc * sizeof(int));
+    list->r = realloc(list->r, list->nalloc * sizeof(float));
+    if (list->neigh == NULL || list->r == NULL) {
+      throw_error("Couldn't grow neighbour list to %d entries", list->nalloc);
+    }
+  }
+
+  int offset = list->nused;
+  list->nused += npad;
+  return (offset);
+}
+
+void part_store_neighbours(int pind, float *r, int *neigh) {
+  /* -------------------------------------------------------
+   * Copy the neighbours of particle with index pind into
+   * freshly reserved space in the calling thread's scratch
+   * neighbour list. part_gather_neighbour_lists() moves
+   * them to the global list once all threads are done.
+   * r, neigh: distances and indices of the neighbours as
+   *           they were left by part_compute_h(), i.e. the
+   *           entries to keep come first.
+   * Padding entries point to the particle itself at an
+   * infinite distance, so they never contribute to
+   * any kernel sum.
+   * Without neighbour lists, there is nothing to keep.
+   * ------------------------------------------------------- */
+
+#ifndef WITHOUT_NEIGHBOUR_LISTS
+  int tid = 0;
+#ifdef _OPENMP
+  tid = omp_get_thread_num();
+#endif
+  neighlist *list = &scratch[tid].list;
+
+#ifdef WITH_VERLET_LISTS
+  int n = particles.nneigh_verlet[pind];
+#else
+  int n = particles.nneigh_iact[pind];
+#endif
+
+  int offset = part_reserve_neighbours(list, n);
+  nlist.offset[pind] = offset;
+  nlist.owner[pind] = tid;
+
+  for (int i = 0; i < n; i++) {
+    list->neigh[offset + i] = neigh[i];
+    list->r[offset + i] = r[i];
+  }
+  for (int i = n; i < list->nused - offset; i++) {
+    list->neigh[offset + i] = pind;
+    list->r[offset + i] = FLT_MAX;
+  }
+#endif
+}
+
+void part_gather_neighbour_lists() {
+  /* -------------------------------------------------------
+   * Concatenate the scratch neighbour lists of all threads
+   * into the global neighbour list, and turn the particle
+   * offsets into offsets in the global list.
+   * ------------------------------------------------------- */
+
+  int *base = malloc(pars.nthreads * sizeof(int));
+  int ntot = 0;
+  for (int t = 0; t < pars.nthreads; t++) {
+    base[t] = ntot;
+    ntot += scratch[t].list.nused;
+  }
+
+  if (ntot > nlist.nalloc) {
+    nlist.nalloc = ntot;
+    debugmessage("Growing neighbour list to %d entries", nlist.nalloc);
+    free(nlist.neigh);
+    free(nlist.r);
+    nlist.neigh = malloc(nlist.nalloc * sizeof(int));
+    nlist.r = malloc(nlist.nalloc * sizeof(float));
+    if (nlist.neigh == NULL || nlist.r == NULL) {
+      throw_error("Couldn't grow neighbour list to %d entries", nlist.nalloc);
+    }
+  }
+  nlist.nused = ntot;
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+  for (int t = 0; t < pars.nthreads; t++) {
+    neighlist *list = &scratch[t].list;
+    memcpy(nlist.neigh + base[t], list->neigh, list->nused * sizeof(int));
+    memcpy(nlist.r + base[t], list->r, list->nused * sizeof(float));
+  }
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+  for (int i = 0; i < pars.npart; i++) {
+    nlist.offset[i] += base[nlist.owner[i]];
+  }
+
+  free(base);
+}
+
+#ifdef NEIGH_LIST_COMPRESSED
+static inline unsigned int part_zigzag(int d) {
+  /* map d = 0, -1, 1, -2, 2, ... to 0, 1, 2, 3, 4, ... */
+  return (d < 0 ? ((unsigned int)(-(d + 1)) << 1) | 1u : (unsigned int)d << 1);
+}
+
+static inline int part_unzigzag(unsigned int v) {
+  /* inverse of part_zigzag() */
+  return ((v & 1u) ? -(int)(v >> 1) - 1 : (int)(v >> 1));
+}
+
+static inline int part_encode_indices(int pind, const int *neigh, int n,
+                                      unsigned char *code) {
+  /* -------------------------------------------------------
+   * Encode the n ascending neighbour indices neigh of
+   * particle pind: the first one relative to pind, the
+   * others relative to the one before, 7 bits per byte
+   * with the highest bit set in all bytes but the last.
+   * If code is NULL, only count the bytes.
+   * Returns the number of bytes.
+   * ------------------------------------------------------- */
+
+  int nbytes = 0;
+  int prev = pind;
+  for (int k = 0; k < n; k++) {
+    unsigned int v =
+        k == 0 ? part_zigzag(neigh[k] - pind) : (unsigned int)(neigh[k] - prev);
+    prev = neigh[k];
+    while (v >= 0x80u) {
+      if (code != NULL)
+        code[nbytes] = (unsigned char)(v | 0x80u);
+      nbytes += 1;
+      v >>= 7;
+    }
+    if (code != NULL)
+      code[nbytes] = (unsigned char)v;
+    nbytes += 1;
+  }
+  return (nbytes);
+}
+
+static inline int part_decode_indices(int pind, const unsigned char *code,
+                                      int n, int *neigh) {
+  /* -------------------------------------------------------
+   * Decode n neighbour indices of particle pind encoded by
+   * part_encode_indices() into neigh.
+   * Returns the number of bytes read.
+   * ------------------------------------------------------- */
+
+  int nbytes = 0;
+  int prev = pind;
+  for (int k = 0; k < n; k++) {
+    unsigned int v = 0;
+    int shift = 0;
+    while (code[nbytes] & 0x80u) {
+      v |= (unsigned int)(code[nbytes] & 0x7fu) << shift;
+      shift += 7;
+      nbytes += 1;
+    }
+    v |= (unsigned int)code[nbytes] << shift;
+    nbytes += 1;
+    prev = k == 0 ? pind + part_unzigzag(v) : prev + (int)v;
+    neigh[k] = prev;
+  }
+  return (nbytes);
+}
+
+static inline void part_sort_neighbours(int *neigh, float *r, int n) {
+  /* sort the n neighbours neigh with their distances r by index. The
+   * lists are short, so insertion sort does. */
+  for (int k = 1; k < n; k++) {
+    int nk = neigh[k];
+    float rk = r[k];
+    int l = k - 1;
+    while (l >= 0 && neigh[l] > nk) {
+      neigh[l + 1] = neigh[l];
+      r[l + 1] = r[l];
+      l -= 1;
+    }
+    neigh[l + 1] = nk;
+    r[l + 1] = rk;
+  }
+}
+
+void part_compress_neighbour_lists() {
+  /* -------------------------------------------------------
+   * Encode the scratch neighbour lists of all threads into
+   * the global compressed neighbour list, the counterpart
+   * of part_gather_neighbour_lists().
+   * The interacting neighbours and, with Verlet lists, the
+   * ones in the skin beyond them, are sorted by index
+   * separately and encoded with part_encode_indices(): a
+   * particle's neighbours sit in a few cells, so after
+   * sorting the differences mostly fit in a single byte.
+   * The distances are stored as 16 bit integers, in units
+   * of the largest distance in the list.
+   * ------------------------------------------------------- */
+
+  int n = pars.npart;
+  int *first = malloc(n * sizeof(int)); /* first entry of particles in rq */
+  if (first == NULL) {
+    throw_error("Couldn't allocate neighbour list offsets");
+  }
+
+  /* sort the lists and count what they need */
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+  for (int i = 0; i < n; i++) {
+    neighlist *list = &scratch[nlist.owner[i]].list;
+    int *neigh = list->neigh + nlist.offset[i];
+    float *r = list->r + nlist.offset[i];
+    int niact = particles.nneigh_iact[i];
+#ifdef WITH_VERLET_LISTS
+    int nstore = particles.nneigh_verlet[i];
+#else
+    int nstore = niact;
+#endif
+    part_sort_neighbours(neigh, r, niact);
+    part_sort_neighbours(neigh + niact, r + niact, nstore - niact);
+    nlist.coffset[i] = part_encode_indices(i, neigh, niact, NULL) +
+                       part_encode_indices(i, neigh + niact, nstore - niact,
+                                           NULL);
+    first[i] = nstore;
+  }
+
+  int nbytes = 0;
+  int ntot = 0;
+  for (int i = 0; i < n; i++) {
+    int b = nlist.coffset[i];
+    nlist.coffset[i] = nbytes;
+    nbytes += b;
+    int e = first[i];
+    first[i] = ntot;
+    ntot += e;
+  }
+
+  if (nbytes > nlist.ncalloc) {
+    nlist.ncalloc = nbytes;
+    debugmessage("Growing compressed neighbour indices to %d bytes",
+                 nlist.ncalloc);
+    free(nlist.code);
+    nlist.code = malloc(nlist.ncalloc);
+    if (nlist.code == NULL) {
+      throw_error("Couldn't grow compressed neighbour indices to %d bytes",
+                  nlist.ncalloc);
+    }
+  }
+  if (ntot > nlist.nalloc) {
+    nlist.nalloc = ntot;
+    debugmessage("Growing compressed neighbour distances to %d entries",
+                 nlist.nalloc);
+    free(nlist.rq);
+    nlist.rq = malloc(nlist.nalloc * sizeof(uint16_t));
+    if (nlist.rq == NULL) {
+      throw_error("Couldn't grow compressed neighbour distances to %d entries",
+                  nlist.nalloc);
+    }
+  }
+  nlist.nused = ntot;
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+  for (int i = 0; i < n; i++) {
+    neighlist *list = &scratch[nlist.owner[i]].list;
+    int *neigh = list->neigh + nlist.offset[i];
+    float *r = list->r + nlist.offset[i];
+    int niact = particles.nneigh_iact[i];
+#ifdef WITH_VERLET_LISTS
+    int nstore = particles.nneigh_verlet[i];
+#else
+    int nstore = niact;
+#endif
+    unsigned char *code = nlist.code + nlist.coffset[i];
+    code += part_encode_indices(i, neigh, niact, code);
+    part_encode_indices(i, neigh + niact, nstore - niact, code);
+
+    float rmax = 0.;
+    for (int k = 0; k < nstore; k++) {
+      if (r[k] > rmax)
+        rmax = r[k];
+    }
+    nlist.rscale[i] = rmax;
+    float fact = rmax > 0. ? 65535. / rmax : 0.;
+    uint16_t *rq = nlist.rq + first[i];
+    for (int k = 0; k < nstore; k++) {
+      rq[k] = (uint16_t)(r[k] * fact + 0.5);
+    }
+  }
+
+  memcpy(nlist.offset, first, n * sizeof(int));
+  free(first);
+}
+#endif
+
+int part_get_neighbours(int pind, int *neigh, float *r) {
+  /* -------------------------------------------------------
+   * Copy the stored neighbours of particle pind from the
+   * global neighbour list into neigh, and their distances
+   * into r unless r is NULL. With NEIGH_LIST_COMPRESSED,
+   * decode them; the distances are then accurate to
+   * 1 / 65535 of the largest one, and the interacting
+   * neighbours and the ones in the skin are each sorted
+   * by index.
+   * Returns the number of neighbours: nneigh_verlet with
+   * Verlet lists, nneigh_iact otherwise.
+   * ------------------------------------------------------- */
+
+#ifdef WITH_VERLET_LISTS
+  int n = particles.nneigh_verlet[pind];
+#else
+  int n = particles.nneigh_iact[pind];
+#endif
+
+#ifdef NEIGH_LIST_COMPRESSED
+  int niact = particles.nneigh_iact[pind];
+  const unsigned char *code = nlist.code + nlist.coffset[pind];
+  code += part_decode_indices(pind, code, niact, neigh);
+  part_decode_indices(pind, code, n - niact, neigh + niact);
+  if (r != NULL) {
+    const uint16_t *rq = nlist.rq + nlist.offset[pind];
+    float fact = nlist.rscale[pind] / 65535.;
+    for (int k = 0; k < n; k++) {
+      r[k] = rq[k] * fact;
+    }
+  }
+#else
+  int offset = nlist.offset[pind];
+  for (int k = 0; k < n; k++) {
+    neigh[k] = nlist.neigh[offset + k];
+  }
+  if (r != NULL) {
+    for (int k = 0; k < n; k++) {
+      r[k] = nlist.r[offset + k];
+    }
+  }
+#endif
+
+  return (n);
+}
+
+#ifdef WITH_PAIR_LISTS
+void part_build_pair_list() {
+  /* -------------------------------------------------------
+   * Build the list of interacting pairs from the neighbour
+   * lists the threads left in their scratch space. If two
+   * particles are within each other's compact support,
+   * both have the pair in their lists; then only the one
+   * with the lower index keeps it.
+   * Particle j has particle i in its list exactly if r_ij
+   * is at most the largest distance in j's list, so that's
+   * what we check instead of comparing to H_j: the lists
+   * were built with the same, symmetric distances.
+   * ------------------------------------------------------- */
+
+  int n = pars.npart;
+  float *rmax = malloc(n * sizeof(float));    /* largest distance in list */
+  int *first = malloc((n + 1) * sizeof(int)); /* first pair of particle */
+  if (rmax == NULL || first == NULL) {
+    throw_error("Couldn't allocate arrays to build pair list");
+  }
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+  for (int i = 0; i < n; i++) {
+    neighlist *list = &scratch[nlist.owner[i]].list;
+    int offset = nlist.offset[i];
+    float r = 0.;
+    for (int k = 0; k < particles.nneigh_iact[i]; k++) {
+      if (list->r[offset + k] > r)
+        r = list->r[offset + k];
+    }
+    rmax[i] = r;
+  }
+
+  /* count the pairs every particle keeps */
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+  for (int i = 0; i < n; i++) {
+    neighlist *list = &scratch[nlist.owner[i]].list;
+    int offset = nlist.offset[i];
+    int count = 0;
+    for (int k = 0; k < particles.nneigh_iact[i]; k++) {
+      int j = list->neigh[offset + k];
+      if (j > i || (j < i && list->r[offset + k] > rmax[j]))
+        count += 1;
+    }
+    first[i + 1] = count;
+  }
+
+  first[0] = 0;
+  for (int i = 0; i < n; i++) {
+    first[i + 1] += first[i];
+  }
+  int npairs = first[n];
+
+  if (npairs > plist.nalloc) {
+    plist.nalloc = npairs;
+    debugmessage("Growing pair list to %d entries", plist.nalloc);
+    free(plist.i);
+    free(plist.j);
+    free(plist.r);
+    plist.i = malloc(plist.nalloc * sizeof(int));
+    plist.j = malloc(plist.nalloc * sizeof(int));
+    plist.r = malloc(plist.nalloc * sizeof(float));
+    if (plist.i == NULL || plist.j == NULL || plist.r == NULL) {
+      throw_error("Couldn't grow pair list to %d entries", plist.nalloc);
+    }
+#ifdef PAIR_LIST_STORE_KERNELS
+    free(plist.Wi);
+    free(plist.Wj);
+    free(plist.dWdri);
+    free(plist.dWdrj);
+    plist.Wi = malloc(plist.nalloc * sizeof(float));
+    plist.Wj = malloc(plist.nalloc * sizeof(float));
+    plist.dWdri = malloc(plist.nalloc * sizeof(float));
+    plist.dWdrj = malloc(plist.nalloc * sizeof(float));
+    if (plist.Wi == NULL || plist.Wj == NULL || plist.dWdri == NULL ||
+        plist.dWdrj == NULL) {
+      throw_error("Couldn't grow pair list to %d entries", plist.nalloc);
+    }
+#endif
+  }
+  plist.npairs = npairs;
+
+  /* fill up pair list, in the same order as the particles */
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+  for (int i = 0; i < n; i++) {
+    neighlist *list = &scratch[nlist.owner[i]].list;
+    int offset = nlist.offset[i];
+    int f = first[i];
+    for (int k = 0; k < particles.nneigh_iact[i]; k++) {
+      int j = list->neigh[offset + k];
+      float r = list->r[offset + k];
+      if (j > i) {
+        plist.i[f] = i;
+        plist.j[f] = j;
+        plist.r[f] = r;
+        f += 1;
+      } else if (j < i && r > rmax[j]) {
+        plist.i[f] = j;
+        plist.j[f] = i;
+        plist.r[f] = r;
+        f += 1;
+      }
+    }
+  }
+
+  log_extra("Stored %d interacting pairs, %.2f per particle", npairs,
+            (float)npairs / n);
+
+  free(rmax);
+  free(first);
+}
+
+static inline void part_pair_density_loop(float *Hinv, float *norm,
+                                          float *rho, float *divv, int ntot,
+                                          const int periodic) {
+  /* -------------------------------------------------------
+   * The pair loop of part_get_densities_pairs(), for
+   * periodic or other boundaries: add the contributions of
+   * every pair to rho and divv of both its particles.
+   * Hinv and norm are the inverse compact support radii
+   * and kernel normalisations, all arrays have ntot
+   * entries.
+   * div v_i = 1/rho_i sum_j m_j (v_j - v_i) . (x_i - x_j)
+   * / r_ij dW/dr. (v_j - v_i) . (x_j - x_i) is the same for
+   * both particles.
+   * ------------------------------------------------------- */
+
+#ifdef _OPENMP
+#pragma omp parallel for reduction(+ : rho[:ntot], divv[:ntot])
+#endif
+  for (int k = 0; k < plist.npairs; k++) {
+    int i = plist.i[k];
+    int j = plist.j[k];
+    float r = plist.r[k];
+
+    float wi, dwdqi, wj, dwdqj;
+    kernel_w_dwdq(r * Hinv[i], &wi, &dwdqi);
+    kernel_w_dwdq(r * Hinv[j], &wj, &dwdqj);
+    /* W = norm * w, dW/dr = norm / H * dw/dq */
+    float Wi = norm[i] * wi;
+    float Wj = norm[j] * wj;
+    float dWdri = norm[i] * Hinv[i] * dwdqi;
+    float dWdrj = norm[j] * Hinv[j] * dwdqj;
+
+    rho[i] += particles.m[j] * Wi;
+    rho[j] += particles.m[i] * Wj;
+
+    float dx = particles.x[0][j] - particles.x[0][i];
+    float dy = particles.x[1][j] - particles.x[1][i];
+    if (periodic)
+      boundary_periodic_image(&dx, &dy);
+    float dvdx =
+        (particles.cold[j].prim.u[0] - particles.cold[i].prim.u[0]) * dx +
+        (particles.cold[j].prim.u[1] - particles.cold[i].prim.u[1]) * dy;
+    float rinv = r > 0. ? 1. / r : 0.; /* particles on top of each other */
+    divv[i] -= particles.m[j] * dvdx * rinv * dWdri;
+    divv[j] -= particles.m[i] * dvdx * rinv * dWdrj;
+
+#ifdef PAIR_LIST_STORE_KERNELS
+    plist.Wi[k] = Wi;
+    plist.Wj[k] = Wj;
+    plist.dWdri[k] = dWdri;
+    plist.dWdrj[k] = dWdrj;
+#endif
+  }
+}
+
+void part_get_densities_pairs() {
+  /* -------------------------------------------------------
+   * Compute the densities and velocity divergences of all
+   * particles, and with them dh/dt, going over the pair
+   * list: the distance of every pair is used for both of
+   * its particles. With PAIR_LIST_STORE_KERNELS, keep the
+   * kernel values of every pair for later interaction
+   * loops.
+   * ------------------------------------------------------- */
+
+  /* pairs with an image particle only count for the particle of the box,
+   * as the particle the image belongs to has its own pair with the image of
+   * the other one. The arrays have space for the images, but what ends up
+   * there is never used. */
+  int n = pars.npart;
+  int ntot = pars.npart + pars.nimage;
+  float *Hinv = malloc(ntot * sizeof(float));
+  float *norm = malloc(ntot * sizeof(float)); /* kernel normalisation */
+  float *rho = malloc(ntot * sizeof(float));
+  float *divv = malloc(ntot * sizeof(float)); /* velocity divergence * rho */
+  if (Hinv == NULL || norm == NULL || rho == NULL || divv == NULL) {
+    throw_error("Couldn't allocate arrays for densities");
+  }
+
+  /* self contribution */
+  float w0, dwdq0;
+  kernel_w_dwdq(0., &w0, &dwdq0);
+  for (int i = 0; i < n; i++) {
+    float H = kernel_Hfromh(particles.h[i]);
+    Hinv[i] = 1. / H;
+    norm[i] = kernel_norm(H);
+    rho[i] = particles.m[i] * norm[i] * w0;
+    divv[i] = 0.;
+  }
+  boundary_copy_to_images(Hinv);
+  boundary_copy_to_images(norm);
+  for (int i = n; i < ntot; i++) {
+    rho[i] = 0.;
+    divv[i] = 0.;
+  }
+
+  if (boundary_search_is_periodic())
+    part_pair_density_loop(Hinv, norm, rho, divv, ntot, 1);
+  else
+    part_pair_density_loop(Hinv, norm, rho, divv, ntot, 0);
+
+  /* store results! h ~ rho^(-1/NDIM), and drho/dt = - rho div v */
+  for (int i = 0; i < n; i++) {
+    particles.cold[i].prim.rho = rho[i];
+    particles.dhdt[i] = particles.h[i] * divv[i] / rho[i] / NDIM;
+  }
+
+  free(Hinv);
+  free(norm);
+  free(rho);
+  free(divv);
+}
+#endif
+
+void part_get_id_order(int *order) {
+  /* ---------------------------------------------------
+   * Particles are re-ordered in memory (e.g. sorted into
+   * cell order), so their array index is not the order
+   * they were read in. Fill up order[] such that
+   * order[i] is the index of the particle with ID i + 1.
+   * order must have space for npart integers.
+   * --------------------------------------------------- */
+
+  for (int i = 0; i < pars.npart; i++) {
+    order[particles.cold[i].id - 1] = i;
+  }
+}
+
+void part_drift(float dt) {
+  /* ---------------------------------------------------
+   * Move all particles with their velocities over a
+   * time step dt, apply the boundary conditions, and
+   * predict their smoothing lengths
+   * with the dh/dt from the last density loop. The
+   * predicted h is the initial guess of the next
+   * smoothing length computation.
+   * --------------------------------------------------- */
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+  for (int i = 0; i < pars.npart; i++) {
+    for (int k = 0; k < 2; k++) {
+      particles.x[k][i] += particles.cold[i].prim.u[k] * dt;
+    }
+    boundary_enforce(i);
+    particles.h[i] += particles.dhdt[i] * dt;
+    if (particles.h[i] < 0.)
+      particles.h[i] = 0.; /* no prediction; guess from scratch */
+  }
+}
+
+void part_find_neighbours() {
+  /* -------------------------------------------------
+   * Top level function to (re)build the neighbour
+   * search structure and determine the smoothing
+   * lengths and neighbours of all particles.
+   * With Verlet lists, the neighbour search is only
+   * redone if the stored lists aren't valid any more.
+   * Logs the time every phase took, so the cost of
+   * recomputing instead of storing neighbours can be
+   * compared between runs.
+   *-------------------------------------------------- */
+
+#ifdef WITH_VERLET_LISTS
+  if (part_refresh_verlet_lists()) {
+    return;
+  }
+  log_extra("Rebuilding neighbour lists");
+  for (int i = 0; i < pars.npart; i++) {
+    particles.r_verlet[i] = 0.;
+  }
+#endif
+
+  if (scratch == NULL)
+    part_init_neighbour_list();
+
+  double build_start = wall_time();
+#if NEIGHBOUR_SEARCH == NGB_TREE
+  if (tree != NULL)
+    tree_destroy();
+  tree_build();
+#else
+  if (grid != NULL)
+    cell_destroy_grid();
+  cell_build_grid();
+#endif
+  log_message("Building the search structure took %.3fs\n",
+              wall_time() - build_start);
+
+  part_get_smoothing_lengths();
+
+#ifdef WITH_VERLET_LISTS
+  for (int i = 0; i < pars.npart; i++) {
+    particles.x_verlet[0][i] = particles.x[0][i];
+    particles.x_verlet[1][i] = particles.x[1][i];
+    particles.r_verlet[i] = (1. + VERLET_SKIN) * kernel_Hfromh(particles.h[i]);
+  }
+#endif
+}
+
+#ifdef WITH_VERLET_LISTS
+int part_refresh_verlet_lists() {
+  /* -------------------------------------------------
+   * Try to compute the smoothing lengths and densities
+   * using the stored Verlet neighbour lists, which
+   * contain all neighbours within r_verlet of each
+   * particle at the time the lists were built.
+   * If the particles moved at most dmax since then,
+   * the lists contain every neighbour within a
+   * distance r_verlet - 2 dmax. So the lists are fine
+   * as long as no particle moved more than half of its
+   * skin and every new H <= r_verlet - 2 dmax.
+   * Returns 1 if that worked, 0 if the lists need to
+   * be rebuilt.
+   *-------------------------------------------------- */
+
+  if (particles.r_verlet[0] == 0.) {
+    return (0); /* lists haven't been built yet */
+  }
+
+  /* find max displacement since lists were built */
+  float dmax = 0.;
+  int nmax = 0; /* max number of stored neighbours */
+
+  for (int i = 0; i < pars.npart; i++) {
+    float dx = particles.x[0][i] - particles.x_verlet[0][i];
+    float dy = particles.x[1][i] - particles.x_verlet[1][i];
+    boundary_nearest_image(&dx, &dy);
+    float d = sqrtf(dx * dx + dy * dy);
+    if (d > dmax)
+      dmax = d;
+    if (particles.nneigh_verlet[i] > nmax)
+      nmax = particles.nneigh_verlet[i];
+  }
+
+  for (int i = 0; i < pars.npart; i++) {
+    float skin = particles.r_verlet[i] - kernel_Hfromh(particles.h[i]);
+    if (2. * dmax > skin) {
+      debugmessage("Particle moved more than half the Verlet skin.");
+      return (0);
+    }
+  }
+
+#if NEIGHBOUR_SEARCH == NGB_GRID
+  /* the lists may contain image particles; move them along */
+  boundary_update_images();
+#endif
+
+  /* refresh distances and redo the smoothing length computation */
+  int *neighs = malloc(nmax * sizeof(int));
+  float *r = malloc(nmax * sizeof(float));
+  float *x = malloc(nmax * sizeof(float));
+  float *y = malloc(nmax * sizeof(float));
+  int valid = 1;
+  long niter = 0; /* total number of smoothing length iterations */
+
+#ifdef NEIGH_LIST_COMPRESSED
+  for (int t = 0; t < pars.nthreads; t++) {
+    scratch[t].list.nused = 0;
+  }
+#endif
+
+  for (int i = 0; i < pars.npart; i++) {
+    int n = part_get_neighbours(i, neighs, NULL);
+    for (int k = 0; k < n; k++) {
+      x[k] = particles.x[0][neighs[k]];
+      y[k] = particles.x[1][neighs[k]];
+    }
+    part_get_distances(i, x, y, r, n);
+    niter += part_compute_h(i, r, neighs, n);
+
+#ifdef NEIGH_LIST_COMPRESSED
+    /* the encoded list may not fit where the old one was; collect the new
+     * lists and encode them all at the end */
+    part_store_neighbours(i, r, neighs);
+#else
+    /* the new list is a subset of the old one, so overwrite it in place
+     * and pad the remainder */
+    int offset = nlist.offset[i];
+    for (int k = 0; k < particles.nneigh_verlet[i]; k++) {
+      nlist.neigh[offset + k] = neighs[k];
+      nlist.r[offset + k] = r[k];
+    }
+    for (int k = particles.nneigh_verlet[i]; k < n; k++) {
+      nlist.neigh[offset + k] = i;
+      nlist.r[offset + k] = FLT_MAX;
+    }
+#endif
+
+    if (kernel_Hfromh(particles.h[i]) + 2. * dmax > particles.r_verlet[i]) {
+      debugmessage("Particle H grew beyond its Verlet list radius.");
+      valid = 0;
+      break;
+    }
+  }
+
+  free(neighs);
+  free(r);
+  free(x);
+  free(y);
+
+  if (valid) {
+#ifdef NEIGH_LIST_COMPRESSED
+    part_compress_neighbour_lists();
+#endif
+    log_extra("Re-used Verlet neighbour lists; max displacement %.3e", dmax);
+    log_message("Smoothing lengths took %.2f iterations per particle\n",
+                (float)niter / pars.npart);
+  }
+
+  return (valid);
+}
+#endif
+
+void part_get_smoothing_lengths() {
+  /* -------------------------------------------------
+   * Determine the smoothing length and the neighbours
+   * to interact with for all particles. Every thread
+   * collects the neighbour lists it produces in its
+   * own scratch list; these are gathered into the global
+   * neighbour list at the end. Without neighbour lists,
+   * the densities are all there is to keep.
+   *-------------------------------------------------- */
+
+  for (int t = 0; t < pars.nthreads; t++) {
+    scratch[t].list.nused = 0;
+  }
+
+  double h_start = wall_time();
+  long niter; /* total number of smoothing length iterations */
+#if NEIGHBOUR_SEARCH == NGB_TREE
+  niter = part_get_smoothing_lengths_tree();
+#elif H_SOLVER == H_SOLVE_SWEEPS
+  niter = part_get_smoothing_lengths_sweeps();
+#elif NDIM == 1
+  niter = part_get_smoothing_lengths_1d();
+#else
+  niter = part_get_smoothing_lengths_grid();
+#endif
+  double h_end = wall_time();
+
+  log_message("Smoothing lengths took %.2f iterations per particle\n",
+              (float)niter / pars.npart);
+  log_message("Smoothing lengths and densities took %.3fs\n", h_end - h_start);
+
+#ifndef WITHOUT_NEIGHBOUR_LISTS
+#ifdef WITH_PAIR_LISTS
+  part_build_pair_list();
+  part_get_densities_pairs();
+  size_t nbytes = plist.nalloc * (2 * sizeof(int) + sizeof(float));
+#ifdef PAIR_LIST_STORE_KERNELS
+  nbytes += plist.nalloc * 4 * sizeof(float);
+#endif
+#elif defined(NEIGH_LIST_COMPRESSED)
+  part_compress_neighbour_lists();
+  size_t nbytes = nlist.ncalloc + nlist.nalloc * sizeof(uint16_t);
+  nbytes += pars.npart * (sizeof(int) + sizeof(float)); /* coffset, rscale */
+#else
+  part_gather_neighbour_lists();
+  size_t nbytes = nlist.nalloc * (sizeof(int) + sizeof(float));
+#endif
+  nbytes += 2 * pars.npart * sizeof(int); /* offsets and owners */
+  size_t nscratch = 0;
+  for (int t = 0; t < pars.nthreads; t++) {
+    nscratch += scratch[t].list.nalloc * (sizeof(int) + sizeof(float));
+  }
+  log_message("Storing neighbours took %.3fs; they take %.1f MB, plus %.1f MB "
+              "scratch space\n",
+              wall_time() - h_end, nbytes / 1048576., nscratch / 1048576.);
+#endif
+}
+
+long part_get_smoothing_lengths_grid() {
+  /* -------------------------------------------------
+   * Determine the smoothing length and the neighbours
+   * to interact with for all particles using the
+   * cell grid to find neighbour candidates.
+   * The halo of a cell has all neighbours within dx of
+   * its particles. If the search radius of a particle
+   * grows beyond that, its batch is done again with the
+   * candidates of all cells within reach; if those reach
+   * beyond the image layers of periodic or reflective
+   * boundaries, add layers and do it all again.
+   * Particles start from the smoothing lengths they got
+   * so far then.
+   * Returns the total number of iterations.
+   *-------------------------------------------------- */
+
+  /* Loop over all cells. The neighbour candidates of each cell
+   * are packed in its halo, see cell_build_halos(), from which
+   * the particle neighbour lists are built. Cells are
+   * independent, but their cost varies with
+   * the number of particles in them, so hand them out
+   * dynamically. */
+
+  long niter = 0;
+
+  while (1) {
+    int mmax = 0; /* cells needed in each direction beyond the layers */
+
+#ifdef _OPENMP
+#pragma omp parallel reduction(+ : niter) reduction(max : mmax)
+#endif
+    {
+      int tid = 0;
+#ifdef _OPENMP
+      tid = omp_get_thread_num();
+#endif
+      part_scratch *s = &scratch[tid];
+      int *cells = malloc((pars.ncelltot + pars.ncellimg) * sizeof(int));
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+      for (int o = 0; o < pars.ncelltot; o++) {
+        int c = cell_order[o];
+
+        /* the candidates are the cell's halo */
+        int *cand = halos.ind + grid[c].hoffset;
+        float *x = halos.x + grid[c].hoffset;
+        float *y = halos.y + grid[c].hoffset;
+        int npctot = grid[c].nhalo;
+        part_scratch_reserve(s, npctot);
+
+        /* Now loop over all particles of this cell, H_BATCH_SIZE at a
+         * time */
+        int batch[H_BATCH_SIZE];
+        int nb = 0;
+        for (int pind = grid[c].offset; pind < grid[c].offset + grid[c].npic;
+             pind++) {
+          batch[nb] = pind;
+          nb += 1;
+          if (nb < H_BATCH_SIZE && pind < grid[c].offset + grid[c].npic - 1)
+            continue;
+
+          niter += part_compute_h_batch(batch, nb, s, cand, x, y, npctot);
+
+          /* redo the batch until its candidates cover all search radii.
+           * Its old neighbour lists stay in the scratch list, unused. */
+          int m = 1;
+          while (1) {
+            float Hmax = 0.;
+            for (int b = 0; b < nb; b++) {
+              float H = kernel_Hfromh(particles.h[batch[b]]);
+              if (H > Hmax)
+                Hmax = H;
+            }
+            int mnew = (int)ceilf(NEIGHBOUR_SEARCH_FACT * Hmax / pars.dx);
+            if (mnew <= m)
+              break;
+            m = mnew;
+            /* beyond transmissive boundaries, there's nothing to miss */
+            if (m > pars.nimglayers &&
+                pars.boundary != BOUNDARY_TRANSMISSIVE) {
+              if (m > mmax)
+                mmax = m;
+              break;
+            }
+            int nc;
+            cell_get_neighbours_within(&grid[c], m, cells, &nc);
+            int n = part_gather_candidates(s, cells, nc);
+            niter += part_compute_h_batch(batch, nb, s, s->allneighs, s->x,
+                                          s->y, n);
+          }
+          nb = 0;
+        }
+      }
+
+      free(cells);
+    }
+
+    if (mmax <= pars.nimglayers)
+      break;
+
+    log_extra("Search radii reach %d cells; adding image layers", mmax);
+    boundary_init_cells(mmax);
+    boundary_build_images();
+    cell_build_halos();
+    for (int t = 0; t < pars.nthreads; t++) {
+      scratch[t].list.nused = 0;
+    }
+  }
+
+  return (niter);
+}
+
+#if NDIM == 1
+long part_get_smoothing_lengths_1d() {
+  /* -------------------------------------------------
+   * Determine the smoothing length and the neighbours
+   * to interact with for all particles in 1D. The
+   * particles of every cell are sorted by x, so going
+   * through the cells of the padded grid from left to
+   * right gives all particles, images included, sorted
+   * by x. The neighbours of a particle are then a
+   * contiguous window around it in that order, see
+   * part_compute_h_window(). If the windows reach
+   * beyond the image layers, add layers and do it all
+   * again.
+   * Returns the total number of iterations.
+   *-------------------------------------------------- */
+
+  int n = pars.npart;
+  int *pos = malloc(n * sizeof(int)); /* position of particles in xs */
+  if (pos == NULL) {
+    throw_error("Couldn't allocate particle positions for 1D search");
+  }
+
+  long niter = 0;
+
+  while (1) {
+    int ntot = pars.npart + pars.nimage;
+    float *xs = malloc(ntot * sizeof(float)); /* x of all particles, sorted */
+    int *ind = malloc(ntot * sizeof(int));    /* their indices */
+    if (xs == NULL || ind == NULL) {
+      throw_error("Couldn't allocate sorted particles for 1D search");
+    }
+
+    int np = pars.nx + 2 * pars.nimglayers;
+    int k = 0;
+    for (int l = 0; l < np; l++) {
+      cell *C = &grid[cell_lookup[l]];
+      for (int m = 0; m < C->npic; m++) {
+        xs[k] = C->sortd[m];
+        ind[k] = C->sorti[m];
+        if (ind[k] < n)
+          pos[ind[k]] = k;
+        k += 1;
+      }
+    }
+
+#ifdef _OPENMP
+#pragma omp parallel reduction(+ : niter)
+#endif
+    {
+      int tid = 0;
+#ifdef _OPENMP
+      tid = omp_get_thread_num();
+#endif
+      part_scratch *s = &scratch[tid];
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 64)
+#endif
+      for (int i = 0; i < n; i++) {
+        niter += part_compute_h_window(i, pos[i], xs, ind, ntot, s);
+      }
+    }
+
+    free(xs);
+    free(ind);
+
+    /* the windows need image cells as far out as they reach. If they reach
+     * beyond the image layers, they were cut off near the boundaries: add
+     * layers, and start over with the neighbour lists */
+    float Hmax = 0.;
+    for (int i = 0; i < n; i++) {
+      float H = kernel_Hfromh(particles.h[i]);
+      if (H > Hmax)
+        Hmax = H;
+    }
+    int m = (int)ceilf(NEIGHBOUR_SEARCH_FACT * Hmax / pars.dx);
+    if (m <= pars.nimglayers)
+      break;
+
+    boundary_init_cells(m);
+    boundary_build_images();
+    cell_sort_particles();
+    for (int t = 0; t < pars.nthreads; t++) {
+      scratch[t].list.nused = 0;
+    }
+  }
+
+  free(pos);
+
+  return (niter);
+}
+
+int part_compute_h_window(int pind, int k, float *xs, int *ind, int ntot,
+                          part_scratch *s) {
+  /* ----------------------------------------------------------------
+   * Compute the smoothing length of particle pind in 1D, and store
+   * its neighbours. xs are the x coordinates of all ntot particles,
+   * images included, in ascending order, ind their indices, and
+   * pind is at position k. The particles within the compact support
+   * radius form the window lo to hi around k. Its two ends move
+   * along with H from one iteration to the next, so every kernel
+   * sum only goes over the particles inside, and neither distance
+   * arrays nor a selection for the initial guess are needed.
+   * Returns the number of iterations.
+   * ---------------------------------------------------------------- */
+
+  float x = xs[k];
+  int lo = k;
+  int hi = k;
+
+  float H = kernel_Hfromh(particles.h[pind]);
+  if (H == 0.) {
+    /* the distance to the nngb-th closest particle, as in part_guess_H():
+     * grow the window by the closer of the next particles on either side */
+    int nguess = (int)(pars.nngb + 0.5);
+    for (int g = 0; g < nguess && (lo > 0 || hi < ntot - 1); g++) {
+      float dlo = lo > 0 ? x - xs[lo - 1] : FLT_MAX;
+      float dhi = hi < ntot - 1 ? xs[hi + 1] - x : FLT_MAX;
+      if (dlo <= dhi) {
+        lo -= 1;
+        H = dlo;
+      } else {
+        hi += 1;
+        H = dhi;
+      }
+    }
+  }
+
+  float Hlo = 0.;
+  float Hhi = FLT_MAX;
+  int niter = 0;
+
+  while (1) {
+    niter += 1;
+
+    /* move the ends of the window to H */
+    while (lo > 0 && x - xs[lo - 1] < H)
+      lo -= 1;
+    while (lo < k && x - xs[lo] >= H)
+      lo += 1;
+    while (hi < ntot - 1 && xs[hi + 1] - x < H)
+      hi += 1;
+    while (hi > k && xs[hi] - x >= H)
+      hi -= 1;
+
+    float Hinv = 1. / H;
+    float wsum = 0.;
+    float dwsum = 0.;
+#ifdef _OPENMP
+#pragma omp simd reduction(+ : wsum, dwsum)
+#endif
+    for (int j = lo; j <= hi; j++) {
+      float q = fabsf(xs[j] - x) * Hinv;
+      float w, dwdq;
+      kernel_w_dwdq(q, &w, &dwdq);
+      wsum += w;
+      dwsum += NDIM * w + q * dwdq;
+    }
+
+    if (part_h_newton_step(&H, &Hlo, &Hhi, wsum, dwsum))
+      break;
+
+    if (niter == ITER_MAX_H) {
+      throw_error("reached max number of iterations for smoothing length of "
+                  "particle %d",
+                  particles.cold[pind].id);
+    }
+  }
 
-void init_part_array() {
-  /* --------------------------------------
-   * Initialize particle array
-   * -------------------------------------- */
+  /* hand the window out to where the neighbour list needs it, with
+   * Verlet lists including the skin, to part_finish_h() */
+  float R = NEIGHBOUR_SEARCH_FACT * H;
+  while (lo > 0 && x - xs[lo - 1] <= R)
+    lo -= 1;
+  while (hi < ntot - 1 && xs[hi + 1] - x <= R)
+    hi += 1;
 
-  log_extra("Initializing particle array");
+  int nneigh = hi - lo + 1;
+  part_scratch_reserve(s, nneigh);
+  for (int j = lo; j <= hi; j++) {
+    s->r[j - lo] = fabsf(xs[j] - x);
+    s->neighs_p[j - lo] = ind[j];
+  }
+  part_finish_h(pind, H, s->r, s->neighs_p, nneigh);
+  part_store_neighbours(pind, s->r, s->neighs_p);
 
-  if (pars.npart == 0) {
-    throw_error("Can't allocate space for particle array: Have npart = 0");
+  return (niter);
+}
+#endif
+
+#if H_SOLVER == H_SOLVE_SWEEPS
+long part_get_smoothing_lengths_sweeps() {
+  /* -------------------------------------------------
+   * Determine the smoothing length and the neighbours
+   * to interact with for all particles using the cell
+   * grid, without gathering and selecting among the
+   * candidates of every particle on its own:
+   *   1) Do one symmetric density sweep over all pairs
+   *      of neighbouring cells with an initial guess
+   *      for H, and a Newton step for every particle.
+   *      This runs as tasks, see sched_init_density().
+   *   2) Keep the unconverged particles in an active
+   *      list, and redo the density loop and Newton
+   *      step for just those until all have converged.
+   *      A particle whose H reaches beyond the direct
+   *      neighbour cells gets a larger cell stencil; if
+   *      that reaches beyond the image cells around the
+   *      box, more layers of them are added.
+   *   3) Collect the neighbours of every particle
+   *      within the converged H and get its density.
+   * Particles with a smoothing length from the last
+   * neighbour search start from that one instead.
+   * Returns the total number of iterations.
+   *-------------------------------------------------- */
+
+  int n = pars.npart;
+  float *H = malloc(n * sizeof(float));
+  float *Hinv = malloc(n * sizeof(float));
+  float *Hlo = malloc(n * sizeof(float));
+  float *Hhi = malloc(n * sizeof(float));
+  float *wsum = malloc(n * sizeof(float));  /* sums of w(q) */
+  float *dwsum = malloc(n * sizeof(float)); /* sums of NDIM w + q dw/dq */
+  int *active = malloc(n * sizeof(int));    /* unconverged particles */
+  int *cellof = malloc(n * sizeof(int));    /* cell of each particle */
+  if (H == NULL || Hinv == NULL || Hlo == NULL || Hhi == NULL ||
+      wsum == NULL || dwsum == NULL || active == NULL || cellof == NULL) {
+    throw_error("Couldn't allocate arrays for density sweeps");
+  }
+
+  /* initial guess for H from the number density around each cell */
+  for (int c = 0; c < pars.ncelltot; c++) {
+    int neighs[9];
+    int nn;
+    cell_get_neighbours_within(&grid[c], 1, neighs, &nn);
+    int npctot = 0;
+    for (int k = 0; k < nn; k++) {
+      npctot += grid[neighs[k]].npic;
+    }
+    /* the sparse grid leaves out empty cells, so use the area of all
+     * 3^NDIM of them */
+    float nloc = npctot / to_ndim_power(3. * pars.dx);
+#if NDIM == 1
+    float Hguess = 0.5 * pars.nngb / nloc;
+#elif NDIM == 2
+    float Hguess = sqrtf(pars.nngb / (PI * nloc));
+#endif
+    for (int P = grid[c].offset; P < grid[c].offset + grid[c].npic; P++) {
+      H[P] = particles.h[P] > 0. ? kernel_Hfromh(particles.h[P]) : Hguess;
+      Hinv[P] = 1. / H[P];
+      Hlo[P] = 0.;
+      Hhi[P] = FLT_MAX;
+      cellof[P] = c;
+    }
+  }
+
+  /* first sweep: density tasks within all cells and between all pairs of
+   * neighbouring cells, and a ghost task per cell for the first Newton
+   * step of its particles once all of its density tasks are done */
+  float w0, dwdq0;
+  kernel_w_dwdq(0., &w0, &dwdq0);
+  for (int i = 0; i < n; i++) {
+    wsum[i] = w0; /* self contribution */
+    dwsum[i] = NDIM * w0;
+  }
+
+  part_sweep_data d;
+  d.H = H;
+  d.Hinv = Hinv;
+  d.Hlo = Hlo;
+  d.Hhi = Hhi;
+  d.wsum = wsum;
+  d.dwsum = dwsum;
+  d.cellof = cellof;
+  d.converged = active; /* only needed until the active list is set up */
+  d.ndist = 0;
+  d.cells =
+      malloc(pars.nthreads * (pars.ncelltot + pars.ncellimg) * sizeof(int));
+  if (d.cells == NULL) {
+    throw_error("Couldn't allocate arrays for density sweeps");
   }
 
-  particles = malloc(pars.npart * sizeof(part));
+  scheduler sched;
+  sched_init_density(&sched);
+  sched_run(&sched, part_density_task, &d);
+  sched_destroy(&sched);
+  free(d.cells);
+  log_extra("First density sweep: %.2f distance evaluations per particle",
+            (float)d.ndist / n);
 
-  for (int p = 0; p < pars.npart; p++) {
-    init_part(&particles[p]);
-    particles[p].id = p + 1;
+  int nactive = 0;
+  for (int i = 0; i < n; i++) {
+    if (!d.converged[i]) {
+      active[nactive] = i;
+      nactive += 1;
+    }
+  }
+  int nsweeps = 1;
+  long niter = n;
+
+  while (1) {
+    if (nactive == 0) {
+      /* the search radii need image cells as far out as they reach. If
+       * they reach beyond the image layers, the sums near the boundaries
+       * were incomplete: add layers, and iterate all particles again */
+      float Hmax = 0.;
+      for (int i = 0; i < n; i++) {
+        if (H[i] > Hmax)
+          Hmax = H[i];
+      }
+      int m = (int)ceilf(NEIGHBOUR_SEARCH_FACT * Hmax / pars.dx);
+      if (m <= pars.nimglayers)
+        break;
+
+      boundary_init_cells(m);
+      boundary_build_images();
+      cell_sort_particles();
+      for (int i = 0; i < n; i++) {
+        active[i] = i;
+        Hlo[i] = 0.;
+        Hhi[i] = FLT_MAX;
+      }
+      nactive = n;
+    }
+
+    if (nsweeps == ITER_MAX_H) {
+      throw_error("reached max number of iterations for smoothing length "
+                  "of particle %d",
+                  particles.cold[active[0]].id);
+    }
+    nsweeps += 1;
+
+    /* redo the density loop for the active particles only */
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+    {
+      int *cells = malloc((pars.ncelltot + pars.ncellimg) * sizeof(int));
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 64)
+#endif
+      for (int a = 0; a < nactive; a++) {
+        int i = active[a];
+        part_get_density_sums(i, cellof[i], H[i], &wsum[i], &dwsum[i], cells);
+      }
+      free(cells);
+    }
+
+    /* Newton step for every active particle; keep the unconverged ones */
+    niter += nactive;
+    int nleft = 0;
+    for (int a = 0; a < nactive; a++) {
+      int i = active[a];
+      if (!part_h_newton_step(&H[i], &Hlo[i], &Hhi[i], wsum[i], dwsum[i])) {
+        active[nleft] = i;
+        nleft += 1;
+      }
+    }
+    nactive = nleft;
+  }
+
+  log_extra("Smoothing lengths converged after %d density sweeps", nsweeps);
+
+  /* now collect the neighbours of every particle and get densities */
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+  {
+    int tid = 0;
+#ifdef _OPENMP
+    tid = omp_get_thread_num();
+#endif
+    part_scratch *s = &scratch[tid];
+    int *cells = malloc((pars.ncelltot + pars.ncellimg) * sizeof(int));
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+    for (int o = 0; o < pars.ncelltot; o++) {
+      int c = cell_order[o];
+      if (grid[c].npic == 0)
+        continue;
+
+      /* make sure the candidates cover the search radius of every
+       * particle of this cell */
+      float Rmax = 0.;
+      for (int P = grid[c].offset; P < grid[c].offset + grid[c].npic; P++) {
+        if (H[P] > Rmax)
+          Rmax = H[P];
+      }
+      int m = (int)ceilf(NEIGHBOUR_SEARCH_FACT * Rmax / pars.dx);
+      if (m < 1)
+        m = 1;
+
+      int nc;
+      cell_get_neighbours_within(&grid[c], m, cells, &nc);
+      int npctot = part_gather_candidates(s, cells, nc);
+
+      for (int P = grid[c].offset; P < grid[c].offset + grid[c].npic; P++) {
+        part_get_distances(P, s->x, s->y, s->r, npctot);
+        memcpy(s->neighs_p, s->allneighs, npctot * sizeof(int));
+        part_finish_h(P, H[P], s->r, s->neighs_p, npctot);
+        part_store_neighbours(P, s->r, s->neighs_p);
+      }
+    }
+
+    free(cells);
   }
+
+  free(H);
+  free(Hinv);
+  free(Hlo);
+  free(Hhi);
+  free(wsum);
+  free(dwsum);
+  free(active);
+  free(cellof);
+
+  return (niter);
 }
 
-void init_part(part *p) {
-  /* ----------------------------------------
-   * Reset all particle values for particle p
-   * DOES NOT RESET PARTICLE ID
-   * ---------------------------------------- */
+void part_density_task(task *t, void *data) {
+  /* -------------------------------------------------
+   * Run a task of the first density sweep, see
+   * part_get_smoothing_lengths_sweeps().
+   *-------------------------------------------------- */
+
+  part_sweep_data *d = data;
+
+  if (t->type == TASK_SELF) {
+    part_density_self(t->ci, d);
+  } else if (t->type == TASK_PAIR) {
+    part_density_pair(t->ci, t->cj, d);
+  } else if (t->type == TASK_GHOST) {
+    part_density_ghost(t->ci, d);
+  }
+}
+
+void part_density_self(int c, part_sweep_data *d) {
+  /* -------------------------------------------------
+   * Add the contributions of all pairs of particles
+   * within cell c to their kernel sums wsum (of w(q))
+   * and dwsum (of NDIM w(q) + q dw/dq(q)), at their
+   * current H. Every pair is visited only once.
+   *-------------------------------------------------- */
 
-  p->x[0] = 0.;
-  p->x[1] = 0.;
-  p->v[0] = 0.;
-  p->v[1] = 0.;
-  p->m = 0.;
-  p->h = 0.;
+  cell *A = &grid[c];
 
-  gas_init_pstate(&(p->prim));
-  gas_init_cstate(&(p->cons));
+  for (int i = A->offset; i < A->offset + A->npic; i++) {
+    float wi = 0.;
+    float dwi = 0.;
+#ifdef _OPENMP
+#pragma omp simd reduction(+ : wi, dwi)
+#endif
+    for (int j = i + 1; j < A->offset + A->npic; j++) {
+      float r = part_get_pair_distance(i, j);
+      float w, dwdq;
+      float q = r * d->Hinv[i];
+      kernel_w_dwdq(q, &w, &dwdq);
+      wi += w;
+      dwi += NDIM * w + q * dwdq;
+      q = r * d->Hinv[j];
+      kernel_w_dwdq(q, &w, &dwdq);
+      d->wsum[j] += w;
+      d->dwsum[j] += NDIM * w + q * dwdq;
+    }
+    d->wsum[i] += wi;
+    d->dwsum[i] += dwi;
+  }
 
-  p->neigh_iact = NULL;
-  p->nneigh_iact = 0;
-  p->r = NULL;
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+  d->ndist += A->npic * (A->npic - 1) / 2;
 }
 
-void free_part_arrays() {
-  /*----------------------------------
-   * Deallocate arrays that are stored
-   * in particle structs
-   * --------------------------------- */
+void part_density_pair(int ci, int cj, part_sweep_data *d) {
+  /* -------------------------------------------------
+   * Add the contributions of all pairs of particles
+   * between the neighbouring cells ci and cj to their
+   * kernel sums, see part_density_self(). If cj is an
+   * image cell, only the particles of ci get theirs.
+   * Walks through the particles of ci from the one
+   * closest to cj onwards along the sort axis between
+   * the cells, and through the particles of cj in the
+   * same direction. A pair with a projected distance
+   * larger than max(H_i, H_j) can't interact, and
+   * neither can any pair further along, so the walks
+   * stop there.
+   *-------------------------------------------------- */
 
-  for (int i = 0; i < pars.npart; i++) {
-    free(particles[i].neigh_iact);
-    free(particles[i].r);
+  cell *A = &grid[ci];
+  cell *B = &grid[cj];
+  if (A->npic == 0 || B->npic == 0)
+    return;
+
+  int axis;
+  int sign = cell_get_pair_axis(A, B, &axis);
+  int symmetric = cj < pars.ncelltot;
+
+  float HmaxA = 0.;
+  for (int i = A->offset; i < A->offset + A->npic; i++) {
+    if (d->H[i] > HmaxA)
+      HmaxA = d->H[i];
+  }
+  float HmaxB = 0.;
+  for (int j = B->offset; symmetric && j < B->offset + B->npic; j++) {
+    if (d->H[j] > HmaxB)
+      HmaxB = d->H[j];
+  }
+  float Hmax = HmaxA > HmaxB ? HmaxA : HmaxB;
+
+  /* projections onto the axis pointing from A towards B: the particles of
+   * A in descending, those of B in ascending order */
+  float *sdA = A->sortd + axis * A->npic;
+  int *siA = A->sorti + axis * A->npic;
+  float *sdB = B->sortd + axis * B->npic;
+  int *siB = B->sorti + axis * B->npic;
+  float pBmin = sign > 0 ? sdB[0] : -sdB[B->npic - 1];
+
+  long ndist = 0;
+  for (int ka = 0; ka < A->npic; ka++) {
+    int a = sign > 0 ? A->npic - 1 - ka : ka;
+    float pi = sign * sdA[a];
+    if (pBmin - pi > Hmax)
+      break; /* all remaining particles of A are even further away */
+
+    int i = siA[a];
+    float Hcut = d->H[i] > HmaxB ? d->H[i] : HmaxB;
+    for (int kb = 0; kb < B->npic; kb++) {
+      int b = sign > 0 ? kb : B->npic - 1 - kb;
+      if (sign * sdB[b] - pi > Hcut)
+        break;
+      int j = siB[b];
+      float r = part_get_pair_distance(i, j);
+      part_density_add(i, r, d);
+      if (symmetric)
+        part_density_add(j, r, d);
+      ndist += 1;
+    }
   }
+
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+  d->ndist += ndist;
 }
 
-void part_get_smoothing_lengths() {
+void part_density_add(int i, float r, part_sweep_data *d) {
   /* -------------------------------------------------
-   * Determine the smoothing length and the neighbours
-   * to interact with for all particles
+   * Add the contribution of a neighbour at distance r
+   * to the kernel sums of particle i.
    *-------------------------------------------------- */
 
-  /* Loop over all cells. Find neighbour cells for each cell,
-   * then build particle neighbour lists based on cell particle
-   * lists */
+  float w, dwdq;
+  float q = r * d->Hinv[i];
+  kernel_w_dwdq(q, &w, &dwdq);
+  d->wsum[i] += w;
+  d->dwsum[i] += NDIM * w + q * dwdq;
+}
 
-  int neighs[9];  /* cell neighbour array */
-  int nn;         /* number of cell neighbours */
-  int npctot;     /* total number of particles in cells + neighbours */
-  int *allneighs; /* all neighbour candidates of particles in a cell */
-  float *r; /* distances of all neighbour candidates of particles in a cell */
-  float
-      *x; /* x coordinate of all neighbour candidates of particles in a cell */
-  float
-      *y; /* y coordinate of all neighbour candidates of particles in a cell */
+void part_density_ghost(int c, part_sweep_data *d) {
+  /* -------------------------------------------------
+   * Once all density tasks of cell c are done: add
+   * the contributions of the neighbouring image cells,
+   * which have no tasks of their own. The sums of
+   * particles whose H reaches beyond the direct
+   * neighbour cells are incomplete, redo those. Then
+   * do the first Newton step for every particle of the
+   * cell.
+   *-------------------------------------------------- */
 
-  for (int c = 0; c < pars.ncelltot; c++) {
-    /* get neighbours */
-    cell_get_neighbours(&grid[c], neighs, &nn);
-
-    /* how many particles are we dealing with here? */
-    npctot = 0;
-    for (int n = 0; n < nn; n++) {
-      npctot += grid[neighs[n]].npic;
-    }
-
-    /* allocate particle neighbour arrays */
-    allneighs = malloc(npctot * sizeof(int));
-    r = malloc(npctot * sizeof(float));
-    x = malloc(npctot * sizeof(float));
-    y = malloc(npctot * sizeof(float));
-
-    /* fill up arrays */
-    int f = 0;
-    for (int n = 0; n < nn; n++) {
-      cell C = grid[neighs[n]];
-      for (int np = 0; np < C.npic; np++) {
-        allneighs[f] = C.cellparts[np];
-        x[f] = particles[allneighs[f]].x[0];
-        y[f] = particles[allneighs[f]].x[1];
-        f += 1;
-      }
+  int tid = 0;
+#ifdef _OPENMP
+  tid = omp_get_thread_num();
+#endif
+  int *cells = d->cells + tid * (pars.ncelltot + pars.ncellimg);
+
+  int nn;
+  cell_get_neighbours(&grid[c], cells, &nn);
+  for (int k = 1; k < nn; k++) {
+    if (cells[k] >= pars.ncelltot)
+      part_density_pair(c, cells[k], d);
+  }
+
+  for (int P = grid[c].offset; P < grid[c].offset + grid[c].npic; P++) {
+    if (d->H[P] > pars.dx)
+      part_get_density_sums(P, c, d->H[P], &d->wsum[P], &d->dwsum[P], cells);
+    d->converged[P] = part_h_newton_step(&d->H[P], &d->Hlo[P], &d->Hhi[P],
+                                         d->wsum[P], d->dwsum[P]);
+  }
+}
+
+void part_get_density_sums(int pind, int c, float H, float *wsum,
+                           float *dwsum, int *cells) {
+  /* -------------------------------------------------
+   * Get the kernel sums wsum (of w(q)) and dwsum (of
+   * NDIM w(q) + q dw/dq(q)) of particle pind, which is
+   * in cell c, for compact support radius H. Searches
+   * as many cells around c as needed to cover H.
+   * cells: scratch array with space for all cells.
+   *-------------------------------------------------- */
+
+  int m = (int)ceilf(H / pars.dx);
+  if (m < 1)
+    m = 1;
+  int nc;
+  cell_get_neighbours_within(&grid[c], m, cells, &nc);
+
+  float Hinv = 1. / H;
+  float ws = 0.;
+  float dws = 0.;
+
+  for (int k = 0; k < nc; k++) {
+    cell *C = &grid[cells[k]];
+#ifdef _OPENMP
+#pragma omp simd reduction(+ : ws, dws)
+#endif
+    for (int j = C->offset; j < C->offset + C->npic; j++) {
+      float q = part_get_pair_distance(pind, j) * Hinv;
+      float w, dwdq;
+      kernel_w_dwdq(q, &w, &dwdq);
+      ws += w;
+      dws += NDIM * w + q * dwdq;
+    }
+  }
+
+  *wsum = ws;
+  *dwsum = dws;
+}
+#endif
+
+int part_gather_candidates(part_scratch *s, int *cells, int ncells) {
+  /* -------------------------------------------------
+   * Collect all particles of the given cells as
+   * neighbour candidates in scratch space s: their
+   * indices in s->allneighs, their coordinates in
+   * s->x and s->y. Returns the number of candidates.
+   *-------------------------------------------------- */
+
+  int npctot = 0;
+  for (int n = 0; n < ncells; n++) {
+    npctot += grid[cells[n]].npic;
+  }
+
+  part_scratch_reserve(s, npctot);
+
+  /* Particles are stored in cell order, so the particles of each cell are
+   * contiguous in memory */
+  int f = 0;
+  for (int n = 0; n < ncells; n++) {
+    cell *C = &grid[cells[n]];
+    for (int P = C->offset; P < C->offset + C->npic; P++) {
+      s->allneighs[f] = P;
+      s->x[f] = particles.x[0][P];
+      s->y[f] = particles.x[1][P];
+      f += 1;
     }
+  }
+
+  return (npctot);
+}
+
+#if NEIGHBOUR_SEARCH == NGB_TREE
+long part_get_smoothing_lengths_tree() {
+  /* -------------------------------------------------
+   * Determine the smoothing length and the neighbours
+   * to interact with for all particles using the tree
+   * to find neighbour candidates.
+   * For each leaf, gather all particles within a search
+   * radius R of the leaf as candidates. If a particle
+   * ends up with a compact support radius H > R (or
+   * (1 + VERLET_SKIN) H > R with Verlet lists), its
+   * neighbours might be incomplete, so increase R and
+   * redo it.
+   * Returns the total number of iterations.
+   *-------------------------------------------------- */
+
+  long niter = 0;
+
+#ifdef _OPENMP
+#pragma omp parallel reduction(+ : niter)
+#endif
+  {
+    int tid = 0;
+#ifdef _OPENMP
+    tid = omp_get_thread_num();
+#endif
+    part_scratch *s = &scratch[tid];
+
+    int *neighs = malloc(pars.ntreenodes * sizeof(int)); /* neighbour leaves */
+    int nn; /* number of neighbour leaves */
+
+    /* leaves are independent, but differ in cost: hand them out
+     * dynamically */
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+    for (int l = 0; l < pars.ntreenodes; l++) {
+      if (!tree[l].leaf)
+        continue;
+
+      treenode *leaf = &tree[l];
+      float R = 2. * leaf->hw; /* search radius */
+      float Rdone = -1.; /* search radius we computed h with. -1: not yet */
+
+      while (1) {
+        tree_get_neighbour_leaves(leaf, R, neighs, &nn);
+
+        /* how many particles are we dealing with here? */
+        int npctot = 0;
+        for (int n = 0; n < nn; n++) {
+          npctot += tree[neighs[n]].npic;
+        }
+
+        if (npctot < CELL_MIN_PARTS_IN_NEIGHBOURHOOD_FACT * pars.nngb &&
+            npctot < pars.npart) {
+          /* too few candidates, look further */
+          R *= 2.;
+          continue;
+        }
 
-    /* Now loop over all particles of this cell */
-    for (int np = 0; np < grid[c].npic; np++) {
-      int pind = grid[c].cellparts[np];
-      /* get particle distances w.r.t. this particle*/
-      for (int n = 0; n < npctot; n++) {
-        float dx = x[n] - particles[pind].x[0];
-        float dy = y[n] - particles[pind].x[1];
-        if (pars.boundary == 0) {
-          /* add periodicity corrections */
-          if (dx > 0.5 * BOXLEN)
-            dx -= BOXLEN;
-          if (dx < -0.5 * BOXLEN)
-            dx += BOXLEN;
-          if (dy > 0.5 * BOXLEN)
-            dy -= BOXLEN;
-          if (dy < -0.5 * BOXLEN)
-            dy += BOXLEN;
+        part_scratch_reserve(s, npctot);
+
+        /* fill up arrays. Particles of each leaf are contiguous in memory */
+        int f = 0;
+        for (int n = 0; n < nn; n++) {
+          treenode *L = &tree[neighs[n]];
+          for (int P = L->offset; P < L->offset + L->npic; P++) {
+            s->allneighs[f] = P;
+            s->x[f] = particles.x[0][P];
+            s->y[f] = particles.x[1][P];
+            f += 1;
+          }
+        }
+
+        /* Now loop over all particles of this leaf that need (re)computing,
+         * H_BATCH_SIZE at a time */
+        int batch[H_BATCH_SIZE];
+        int nb = 0;
+        for (int pind = leaf->offset; pind < leaf->offset + leaf->npic;
+             pind++) {
+          float Hsearch =
+              NEIGHBOUR_SEARCH_FACT * kernel_Hfromh(particles.h[pind]);
+          if (Rdone < 0. || Hsearch > Rdone) {
+            /* a recomputed particle gets a new entry in the neighbour
+             * list; its old one is simply left unused until the next
+             * rebuild */
+            batch[nb] = pind;
+            nb += 1;
+          }
+          if (nb == H_BATCH_SIZE ||
+              (nb > 0 && pind == leaf->offset + leaf->npic - 1)) {
+            niter += part_compute_h_batch(batch, nb, s, s->allneighs, s->x,
+                                          s->y, npctot);
+            nb = 0;
+          }
+        }
+
+        float Hmax = 0.;
+        for (int pind = leaf->offset; pind < leaf->offset + leaf->npic;
+             pind++) {
+          float H = NEIGHBOUR_SEARCH_FACT * kernel_Hfromh(particles.h[pind]);
+          if (H > Hmax)
+            Hmax = H;
+        }
+
+        if (Hmax <= R || npctot == pars.npart)
+          break;
+
+        /* some particles need more candidates. */
+        Rdone = R;
+        while (R < Hmax) {
+          R *= 2.;
         }
-        r[n] = sqrtf(dx * dx + dy * dy);
       }
-      part_compute_h(&particles[pind], r, allneighs, npctot);
     }
 
-    /* free arrays for this cell */
-    free(allneighs);
-    free(r);
-    free(x);
-    free(y);
+    free(neighs);
+  }
+
+  return (niter);
+}
+#endif
+
+static inline void part_get_distances_loop(int pind, float *x, float *y,
+                                           float *r, int n,
+                                           const int periodic) {
+  /* ----------------------------------------------------------------
+   * The loop of part_get_distances(), for periodic or other
+   * boundaries: the distances r of the n candidates at x, y to
+   * particle pind.
+   * ---------------------------------------------------------------- */
+
+  float px = particles.x[0][pind];
+  float py = particles.x[1][pind];
+
+  for (int i = 0; i < n; i++) {
+    float dx = x[i] - px;
+    float dy = y[i] - py;
+    if (periodic)
+      boundary_periodic_image(&dx, &dy);
+    r[i] = sqrtf(dx * dx + dy * dy);
+  }
+}
+
+void part_get_distances(int pind, float *x, float *y, float *r, int n) {
+  /* ----------------------------------------------------------------
+   * Compute the distances of particle with index pind to n neighbour
+   * candidates with coordinates x, y and store them in r.
+   * ---------------------------------------------------------------- */
+
+  if (boundary_search_is_periodic())
+    part_get_distances_loop(pind, x, y, r, n, 1);
+  else
+    part_get_distances_loop(pind, x, y, r, n, 0);
+}
+
+float part_get_pair_distance(int i, int j) {
+  /* ----------------------------------------------------------------
+   * Get the distance between the particles with indices i and j.
+   * ---------------------------------------------------------------- */
+
+  float dx = particles.x[0][j] - particles.x[0][i];
+  float dy = particles.x[1][j] - particles.x[1][i];
+#if NEIGHBOUR_SEARCH == NGB_TREE
+  /* the tree has no image particles */
+  boundary_nearest_image(&dx, &dy);
+#endif
+  return (sqrtf(dx * dx + dy * dy));
+}
+
+int part_partition(int start, int n, int dim, float split) {
+  /* ----------------------------------------------------------------
+   * Partition the n particles starting at index start in place such
+   * that all particles with x[dim] < split come first. Returns the
+   * number of particles with x[dim] < split.
+   * ---------------------------------------------------------------- */
+
+  int i = start;
+  int j = start + n - 1;
+
+  while (i <= j) {
+    if (particles.x[dim][i] < split) {
+      i += 1;
+    } else {
+      part_swap(i, j);
+      j -= 1;
+    }
   }
+
+  return (i - start);
 }
 
-void part_compute_h(part *p, float *r, int *neigh, int nneigh) {
+int part_compute_h(int pind, float *r, int *neigh, int nneigh) {
   /* ----------------------------------------------------------------
-   * Iteratively compute the smoothing length for given particle p.
+   * Iteratively compute the smoothing length for particle with
+   * index pind.
    * r:      distances to all neighbouring particles
    * neigh:  array of neighbour particle indices
    * nneigh: number of elements in neigh array
+   * r and neigh are re-ordered in place such that the neighbours to
+   * keep come first: first the nneigh_iact ones to interact with,
+   * then (with Verlet lists) the ones in the skin.
+   * Starts from the particle's current (predicted) smoothing length,
+   * if it has one. Returns the number of iterations.
+   * ---------------------------------------------------------------- */
+
+  float Hi = kernel_Hfromh(particles.h[pind]);
+  if (Hi == 0.)
+    Hi = part_guess_H(r, neigh, nneigh);
+  float Hlo = 0.;      /* largest H found with f(H) < 0 */
+  float Hhi = FLT_MAX; /* smallest H found with f(H) > 0 */
+
+  int niter = 0;
+  int converged = 0;
+
+  while (!converged && niter < ITER_MAX_H) {
+    niter += 1;
+
+    float Hinv = 1. / Hi;
+    float wsum = 0.;  /* sum of dimensionless kernel shapes */
+    float dwsum = 0.; /* sum of NDIM * w + q * dw/dq */
+
+    /* do neighbour loop. r is unsorted, so go over every candidate. The
+     * kernel vanishes for q > 1 without branching, so there is no need to
+     * skip the ones outside of H, and the loop vectorises. */
+#ifdef _OPENMP
+#pragma omp simd reduction(+ : wsum, dwsum)
+#endif
+    for (int i = 0; i < nneigh; i++) {
+      float q = r[i] * Hinv;
+      float w, dwdq;
+      kernel_w_dwdq(q, &w, &dwdq);
+      wsum += w;
+      dwsum += NDIM * w + q * dwdq;
+    }
+
+    converged = part_h_newton_step(&Hi, &Hlo, &Hhi, wsum, dwsum);
+  }
+
+  if (!converged) {
+    throw_error(
+        "reached max number of iterations for smoothing length of particle %d",
+        particles.cold[pind].id);
+  }
+
+  part_finish_h(pind, Hi, r, neigh, nneigh);
+
+  return (niter);
+}
+
+static inline void part_get_sq_distances_batch(const float *px,
+                                               const float *py, float *x,
+                                               float *y, float *d2, int n,
+                                               const int periodic) {
+  /* ----------------------------------------------------------------
+   * Compute the squared distances of H_BATCH_SIZE particles at px, py
+   * to n neighbour candidates with coordinates x, y, interleaved:
+   * d2[i * H_BATCH_SIZE + b].
    * ---------------------------------------------------------------- */
 
-  /* create copies of neigh array so you can safely play with them */
-  int *neighcpy = malloc(nneigh * sizeof(int));
-  for (int i = 0; i < nneigh; i++) {
-    neighcpy[i] = neigh[i];
+  for (int i = 0; i < n; i++) {
+    float *d2i = d2 + i * H_BATCH_SIZE;
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+    for (int b = 0; b < H_BATCH_SIZE; b++) {
+      float dx = x[i] - px[b];
+      float dy = y[i] - py[b];
+      if (periodic)
+        boundary_periodic_image(&dx, &dy);
+      d2i[b] = dx * dx + dy * dy;
+    }
+  }
+}
+
+int part_filter_candidates(const float *d2, int n, float R, float *rkept) {
+  /* ----------------------------------------------------------------
+   * Keep the neighbour candidates that are closer than R to at least
+   * one particle of a batch, given their n interleaved squared
+   * distances d2 (see part_compute_h_batch()), and store their
+   * distances in rkept, in the same layout. Only squared distances
+   * are compared; the square root is only taken for the candidates
+   * that are kept. Every row is stored, and the next one overwrites
+   * it unless it is kept, so there are no branches to mispredict.
+   * Returns the number of candidates kept.
+   * ---------------------------------------------------------------- */
+
+  float R2 = R * R;
+  int nkeep = 0;
+
+  for (int i = 0; i < n; i++) {
+    const float *d2i = d2 + i * H_BATCH_SIZE;
+    float *rk = rkept + nkeep * H_BATCH_SIZE;
+    int keep = 0;
+#ifdef _OPENMP
+#pragma omp simd reduction(| : keep)
+#endif
+    for (int b = 0; b < H_BATCH_SIZE; b++) {
+      rk[b] = d2i[b];
+      keep |= d2i[b] < R2;
+    }
+    nkeep += keep;
+  }
+
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+  for (int i = 0; i < nkeep * H_BATCH_SIZE; i++) {
+    rkept[i] = sqrtf(rkept[i]);
   }
 
-  /* sort neighcpy and r array by increasing r */
-  quicksort_float_int_follower(r, neighcpy, nneigh);
+  return (nkeep);
+}
+
+int part_compute_h_batch(int *pinds, int nb, part_scratch *s, int *cand,
+                         float *x, float *y, int ncand) {
+  /* ----------------------------------------------------------------
+   * Compute the smoothing lengths of the nb <= H_BATCH_SIZE
+   * particles with indices pinds, and store their neighbours.
+   * They all share the ncand neighbour candidates cand with
+   * coordinates x, y. s needs space for ncand candidates. The
+   * particles are iterated
+   * together, one per SIMD lane: the kernel sums for all of them
+   * are done in a single pass over the candidates, and each lane
+   * stops updating once it has converged.
+   * Only candidates within H_FILTER_FACT * H of some particle take
+   * part in the iteration. The kernel vanishes beyond H, so the
+   * sums stay exactly the same as long as no H grows past that
+   * radius; if one does, the candidates are filtered again.
+   * Returns the sum of the particles' numbers of iterations.
+   * ---------------------------------------------------------------- */
+
+  float *d2 = s->rbatch;
+  float H[H_BATCH_SIZE];
+  float Hlo[H_BATCH_SIZE];
+  float Hhi[H_BATCH_SIZE];
+  int active[H_BATCH_SIZE];
+  float px[H_BATCH_SIZE];
+  float py[H_BATCH_SIZE];
 
-  /* take initial guess for compact support radius for this particle */
-  float Hi = r[(int)(pars.nngb + 0.5)];
+  /* get squared distances. Spare lanes get copies of the last particle
+   * and are never active. */
+  for (int b = 0; b < H_BATCH_SIZE; b++) {
+    int pind = pinds[b < nb ? b : nb - 1];
+    px[b] = particles.x[0][pind];
+    py[b] = particles.x[1][pind];
+    Hlo[b] = 0.;
+    Hhi[b] = FLT_MAX;
+    active[b] = b < nb;
+  }
+  if (boundary_search_is_periodic())
+    part_get_sq_distances_batch(px, py, x, y, d2, ncand, 1);
+  else
+    part_get_sq_distances_batch(px, py, x, y, d2, ncand, 0);
 
-  float eta_to_ndim = to_ndim_power(pars.eta);
+  /* Start from the particles' current (predicted) smoothing lengths. For
+   * those that don't have one yet: the particles of a batch are close to
+   * each other, so one initial guess is good enough for all of them. Take
+   * it from the last particle. Selecting among the squared distances picks
+   * the same candidate as among the distances. */
+  int nguess = 0;
+  for (int b = 0; b < nb; b++) {
+    H[b] = kernel_Hfromh(particles.h[pinds[b]]);
+    if (H[b] == 0.)
+      nguess += 1;
+  }
+  if (nguess > 0) {
+    for (int i = 0; i < ncand; i++) {
+      s->r[i] = d2[i * H_BATCH_SIZE + nb - 1];
+    }
+    float Hguess = sqrtf(part_guess_H(s->r, s->neighs_p, ncand));
+    for (int b = 0; b < nb; b++) {
+      if (H[b] == 0.)
+        H[b] = Hguess;
+    }
+  }
+  for (int b = nb; b < H_BATCH_SIZE; b++) {
+    H[b] = BOXLEN; /* spare lanes are never active, any H will do */
+  }
 
+  int nactive = nb;
   int niter = 0;
+  int niter_tot = 0;
+  float Rfilter = 0.; /* radius the kept candidates are complete within */
+  int nkeep = 0;
 
-  while (niter < ITER_MAX_H) {
+  while (nactive > 0 && niter < ITER_MAX_H) {
     niter += 1;
 
-    float hi = kernel_hfromH(Hi);
-    float ni = 0.; /* number density of particle */
-    float dfdh_dWdrsum =
-        0.; /* kernel sum for df/dh that includes the dW/dr terms */
-
-    /* do neighbour loop */
-    for (int i = 0; r[i] <= Hi; i++) {
-      float W = kernel_W(r[i], hi);
-      float dWdr = kernel_dWdr(r[i], hi);
-      ni += W;
-      dfdh_dWdrsum += (NDIM * W + r[i] * dWdr);
-      if (i == nneigh - 1)
-        break; /* safety measure */
-    }
-
-    /* now compute f and df/dh */
-    float hi_to_ndim = to_ndim_power(hi);
-    float hi_to_ndim_minus_one = hi_to_ndim / hi;
-    float f = hi_to_ndim * ni - eta_to_ndim;
-    float dfdh =
-        NDIM * hi_to_ndim_minus_one * ni - hi_to_ndim_minus_one * dfdh_dWdrsum;
-
-    float Hinew = Hi - f / dfdh;
-    if (fabs(Hinew - Hi) < EPSILON_H * Hi) {
-      Hi = Hinew;
-      break;
-    } else {
-      Hi = Hinew;
+    float Hmax = 0.;
+    for (int b = 0; b < H_BATCH_SIZE; b++) {
+      if (active[b] && H[b] > Hmax)
+        Hmax = H[b];
+    }
+    if (Hmax > Rfilter) {
+      Rfilter = H_FILTER_FACT * Hmax;
+      nkeep = part_filter_candidates(d2, ncand, Rfilter, s->rkept);
+    }
+
+    float Hinv[H_BATCH_SIZE];
+    float wsum[H_BATCH_SIZE];
+    float dwsum[H_BATCH_SIZE];
+    for (int b = 0; b < H_BATCH_SIZE; b++) {
+      Hinv[b] = 1. / H[b];
+      wsum[b] = 0.;
+      dwsum[b] = 0.;
+    }
+
+    /* neighbour loop for all lanes at once, converged ones included */
+    for (int i = 0; i < nkeep; i++) {
+      const float *ri = s->rkept + i * H_BATCH_SIZE;
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+      for (int b = 0; b < H_BATCH_SIZE; b++) {
+        float q = ri[b] * Hinv[b];
+        float w, dwdq;
+        kernel_w_dwdq(q, &w, &dwdq);
+        wsum[b] += w;
+        dwsum[b] += NDIM * w + q * dwdq;
+      }
+    }
+
+    for (int b = 0; b < H_BATCH_SIZE; b++) {
+      if (!active[b])
+        continue;
+      if (part_h_newton_step(&H[b], &Hlo[b], &Hhi[b], wsum[b], dwsum[b])) {
+        active[b] = 0;
+        nactive -= 1;
+        niter_tot += niter;
+      }
     }
   }
 
-  if (niter == ITER_MAX_H) {
-    throw_error(
-        "reached max number of iterations for smoothing length of particle %d",
-        p->id);
+  for (int b = 0; b < nb; b++) {
+    if (active[b]) {
+      throw_error("reached max number of iterations for smoothing length of "
+                  "particle %d",
+                  particles.cold[pinds[b]].id);
+    }
+  }
+
+  /* now finish up every particle on its own, with only the candidates
+   * within the radius its neighbour list needs */
+  for (int b = 0; b < nb; b++) {
+    float Rstore = NEIGHBOUR_SEARCH_FACT * H[b];
+#ifdef WITH_VERLET_LISTS
+    if (Rstore < particles.r_verlet[pinds[b]])
+      Rstore = particles.r_verlet[pinds[b]];
+#endif
+    float R2 = Rstore * Rstore;
+    int nneigh = 0;
+    for (int i = 0; i < ncand; i++) {
+      float d2i = d2[i * H_BATCH_SIZE + b];
+      s->r[nneigh] = d2i;
+      s->neighs_p[nneigh] = cand[i];
+      nneigh += d2i <= R2;
+    }
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+    for (int i = 0; i < nneigh; i++) {
+      s->r[i] = sqrtf(s->r[i]);
+    }
+    part_finish_h(pinds[b], H[b], s->r, s->neighs_p, nneigh);
+    part_store_neighbours(pinds[b], s->r, s->neighs_p);
   }
 
-  /* once you're done iterating, get density of the particle */
-  float rhoi = 0.; /* density of this particle */
+  return (niter_tot);
+}
+
+float part_guess_H(float *r, int *neigh, int nneigh) {
+  /* ----------------------------------------------------------------
+   * Take initial guess for compact support radius for a particle:
+   * the distance to the nngb-th closest candidate. We only need that
+   * one element, not a fully sorted r array, so select it. This
+   * re-orders r and neigh.
+   * ---------------------------------------------------------------- */
+
+  int k = (int)(pars.nngb + 0.5);
+  if (k > nneigh - 1)
+    k = nneigh - 1;
+  return (quickselect_float_int_follower(r, neigh, nneigh, k));
+}
+
+int part_h_newton_step(float *H, float *Hlo, float *Hhi, float wsum,
+                       float dwsum) {
+  /* ----------------------------------------------------------------
+   * Do one Newton-Raphson step for the compact support radius H of
+   * a particle, given the sums over all neighbours of w(q) and of
+   * NDIM * w(q) + q dw/dq(q) at the current H.
+   * f = h^NDIM n - eta^NDIM grows monotonically with H, so Hlo and
+   * Hhi, the largest H with f < 0 and the smallest H with f > 0
+   * found so far, bracket the root. They are updated here. If the
+   * Newton step leaves the bracket, bisect instead, or double H if
+   * there is no upper bound yet.
+   * Returns 1 if H has converged, 0 otherwise.
+   * ---------------------------------------------------------------- */
+
+  float Hi = *H;
   float hi = kernel_hfromH(Hi);
 
-  /* do neighbour loop */
-  for (int i = 0; r[i] <= Hi; i++) {
-    part pj = particles[neighcpy[i]];
-    rhoi += pj.m * kernel_W(r[i], hi);
-    if (i == nneigh - 1)
-      break; /* safety measure */
-  }
+  /* the kernel normalisation is the same for all neighbours, so apply it
+   * only now. With W = norm * w and dW/dr = norm / H * dw/dq:
+   * NDIM * W + r * dW/dr = norm * (NDIM * w + q * dw/dq) */
+  float norm = kernel_norm(Hi);
+  float ni = norm * wsum; /* number density of particle */
+  float dfdh_dWdrsum =
+      norm * dwsum; /* kernel sum for df/dh that includes the dW/dr terms */
+
+  /* now compute f and df/dh */
+  float hi_to_ndim = to_ndim_power(hi);
+  float hi_to_ndim_minus_one = hi_to_ndim / hi;
+  float f = hi_to_ndim * ni - to_ndim_power(pars.eta);
+  float dfdh =
+      NDIM * hi_to_ndim_minus_one * ni - hi_to_ndim_minus_one * dfdh_dWdrsum;
 
-  /* store results! */
-  p->h = hi;
-  p->prim.rho = rhoi;
+  if (f < 0.) {
+    *Hlo = Hi;
+  } else if (f > 0.) {
+    *Hhi = Hi;
+  }
 
-  /* now get neighbours array size */
-  p->nneigh_iact = 0;
-  for (int i = 0; r[i] <= Hi; i++) {
-    p->nneigh_iact += 1;
+  /* the derivative is w.r.t. h, so take the step in h */
+  float Hinew = kernel_Hfromh(hi - f / dfdh);
+  /* Hinew may round to Hi, which is now one of the bounds. That's
+   * converged, not outside the bracket. */
+  if (!(Hinew >= *Hlo && Hinew <= *Hhi)) {
+    if (*Hhi < FLT_MAX) {
+      Hinew = 0.5 * (*Hlo + *Hhi);
+    } else {
+      Hinew = 2. * Hi;
+    }
   }
 
-  /* allocate exact size arrays */
-  p->neigh_iact = malloc(p->nneigh_iact * sizeof(int));
-  p->r = malloc(p->nneigh_iact * sizeof(float));
+  *H = Hinew;
+  return (fabs(Hinew - Hi) < EPSILON_H * Hi);
+}
+
+#ifndef WITH_PAIR_LISTS
+static inline void part_density_loop(int pind, float Hinv, float *r,
+                                     int *neigh, int n, float *rho,
+                                     float *divv, const int periodic) {
+  /* ----------------------------------------------------------------
+   * The neighbour loop of part_finish_h(), for periodic or other
+   * boundaries: sum up w(q) and -m_j (v_j - v_i) . (x_j - x_i) / r
+   * dw/dq over the n neighbours neigh of particle pind at distances
+   * r, with q = r * Hinv, into rho and divv.
+   * div v_i = 1/rho_i sum_j m_j (v_j - v_i) . (x_i - x_j) / r_ij dW/dr
+   * ---------------------------------------------------------------- */
+
+  float rhoi = 0.;
+  float divvi = 0.;
+  float xi = particles.x[0][pind];
+  float yi = particles.x[1][pind];
+  float uxi = particles.cold[pind].prim.u[0];
+  float uyi = particles.cold[pind].prim.u[1];
 
-  /* and fill them up */
-  for (int i = 0; i < p->nneigh_iact; i++) {
-    p->neigh_iact[i] = neighcpy[i];
-    p->r[i] = r[i];
+#ifdef _OPENMP
+#pragma omp simd reduction(+ : rhoi, divvi)
+#endif
+  for (int i = 0; i < n; i++) {
+    int j = neigh[i];
+    float q = r[i] * Hinv;
+    float w, dwdq;
+    kernel_w_dwdq(q, &w, &dwdq);
+    rhoi += particles.m[j] * w;
+
+    float dx = particles.x[0][j] - xi;
+    float dy = particles.x[1][j] - yi;
+    if (periodic)
+      boundary_periodic_image(&dx, &dy);
+    float dvdx = (particles.cold[j].prim.u[0] - uxi) * dx +
+                 (particles.cold[j].prim.u[1] - uyi) * dy;
+    float rinv = r[i] > 0. ? 1. / r[i] : 0.; /* the particle itself */
+    divvi -= particles.m[j] * dvdx * rinv * dwdq;
   }
 
-  free(neighcpy);
+  *rho = rhoi;
+  *divv = divvi;
+}
+#endif
+
+void part_finish_h(int pind, float Hi, float *r, int *neigh, int nneigh) {
+  /* ----------------------------------------------------------------
+   * Store the converged compact support radius Hi of particle pind
+   * and compute its density, and dh/dt from the velocity divergence.
+   * r and neigh are the distances to and indices of all nneigh
+   * neighbour candidates. They are re-ordered such that the
+   * neighbours to keep come first, see part_compute_h().
+   * With pair lists, the densities are computed for all particles
+   * at once later, see part_get_densities_pairs().
+   * ---------------------------------------------------------------- */
+
+  /* move the neighbours within the compact support to the front */
+  int nneigh_iact = partition_float_int_follower(r, neigh, nneigh, Hi);
+
+  float hi = kernel_hfromH(Hi);
+  particles.h[pind] = hi;
+  particles.nneigh_iact[pind] = nneigh_iact;
+
+#ifndef WITH_PAIR_LISTS
+  /* get density and velocity divergence of the particle */
+  float rhoi; /* density of this particle */
+  float divv; /* velocity divergence of this particle */
+  float Hinv = 1. / Hi;
+  if (boundary_search_is_periodic())
+    part_density_loop(pind, Hinv, r, neigh, nneigh_iact, &rhoi, &divv, 1);
+  else
+    part_density_loop(pind, Hinv, r, neigh, nneigh_iact, &rhoi, &divv, 0);
+  float norm = kernel_norm(Hi);
+  rhoi *= norm;
+  /* dW/dr = norm / H * dw/dq */
+  divv *= norm * Hinv / rhoi;
+
+  /* store results! h ~ rho^(-1/NDIM), and drho/dt = - rho div v */
+  particles.dhdt[pind] = hi * divv / NDIM;
+  particles.cold[pind].prim.rho = rhoi;
+#endif
+
+#ifdef WITH_VERLET_LISTS
+  /* keep the candidates within the skin as well, stored after the
+   * interacting neighbours. When refreshing an existing list, keep all
+   * of it. */
+  float Rstore = (1. + VERLET_SKIN) * Hi;
+  if (Rstore < particles.r_verlet[pind])
+    Rstore = particles.r_verlet[pind];
+  particles.nneigh_verlet[pind] =
+      nneigh_iact + partition_float_int_follower(r + nneigh_iact,
+                                                 neigh + nneigh_iact,
+                                                 nneigh - nneigh_iact, Rstore);
+#endif
 }
 
 void part_print_all(void) {
@@ -280,19 +2663,19 @@ void part_print_range(int start, int stop) {
                   "start=%d, stop=%d",
                   i, pars.npart, start, stop);
     }
-    part p = particles[i];
-    part_print_properties(&p);
+    part_print_properties(i);
   }
 }
 
-void part_print_properties(part *p) {
+void part_print_properties(int i) {
   /* ----------------------------------------------------
-   * Print a single particle's properties
+   * Print the properties of particle with index i
    * ---------------------------------------------------- */
 
+  part *p = &particles.cold[i];
   printf("%5d %8.3f %8.3f %8.3f %8.3f %8.3f %8.3f %8.3f %8.3f\n", p->id,
-         p->x[0], p->x[1], p->m, p->prim.rho, p->prim.u[0], p->prim.u[1],
-         p->prim.p, p->h);
+         particles.x[0][i], particles.x[1][i], particles.m[i], p->prim.rho,
+         p->prim.u[0], p->prim.u[1], p->prim.p, particles.h[i]);
 }
 
 void part_print_header(void) {
@@ -322,10 +2705,14 @@ void part_write_smoothing_lengths(int step) {
 
   FILE *outfilep = fopen(filename, "w");
 
+  /* write in order of particle IDs, not array indices */
+  int *order = malloc(pars.npart * sizeof(int));
+  part_get_id_order(order);
+
   for (int i = 0; i < pars.npart; i++) {
-    part p = particles[i];
-    fprintf(outfilep, "%6d  %12.6e\n", i, p.h);
+    fprintf(outfilep, "%6d  %12.6e\n", i, particles.h[order[i]]);
   }
 
+  free(order);
   fclose(outfilep);
 }
@@ -6,41 +6,210 @@
 #ifndef PARTICLE_H
 #define PARTICLE_H
 
+#include "defines.h"
 #include "gas.h"
+#include "task.h"
 
-/* particle struct */
+#include <stddef.h>
+#include <stdint.h>
+
+/* alignment of the particle data arrays, in bytes */
+#define PART_ARRAY_ALIGN 64
+
+/* cold particle data: everything the neighbour search and smoothing
+ * length loops don't touch. Only the velocities are read there, once per
+ * particle, for the velocity divergence */
 typedef struct {
 
   int id; /* particle ID */
 
-  float x[2]; /* particle position */
-  float v[2]; /* particle velocity */
-  float m;    /* particle mass */
-  float h;    /* particle smoothing length */
-
   pstate prim; /* primitive fluid state */
   cstate cons; /* conserved fluid state */
 
-  int *neigh_iact; /* neighbours we interact with */
-  int nneigh_iact; /* number of neighbours to interact with; = sizes of
-                      neigh_iact and r arrays */
-  float *r;        /* distances to neighbours to interact with */
-
 } part;
 
+/* particle store. The fields used in the neighbour search and smoothing
+ * length loops are kept in separate, aligned arrays, one per field, so
+ * those loops stream through contiguous memory. Everything else lives in
+ * the cold array of part structs. All arrays are indexed by the particle
+ * index; use part_copy() and part_swap() to move whole particles. */
+typedef struct {
+
+  float *x[2];      /* particle positions: x[k][i] is coordinate k of
+                       particle i */
+  float *h;         /* particle smoothing lengths */
+  float *dhdt;      /* rate of change of the smoothing lengths, from the
+                       velocity divergence. Used to predict h for the next
+                       neighbour search */
+  float *m;         /* particle masses */
+  int *nneigh_iact; /* number of neighbours to interact with. The neighbours
+                       themselves are stored in the global neighbour list,
+                       unless compiled with WITHOUT_NEIGHBOUR_LISTS */
+
+#ifdef WITH_VERLET_LISTS
+  int *nneigh_verlet; /* number of neighbours stored in the neighbour list,
+                         including the ones in the skin beyond H. The
+                         first nneigh_iact entries are the ones to interact
+                         with, the skin follows after them. */
+  float *x_verlet[2]; /* particle positions when the lists were built */
+  float *r_verlet;    /* radius within which the lists contained all
+                         neighbours when they were built */
+#endif
+
+  part *cold; /* cold particle data */
+
+  int nalloc; /* number of particles the arrays have space for: the npart
+                 particles of the box and the image particles after them */
+
+} partstore;
+
+/* neighbour lists of all particles, stored in flat arrays: the neighbours
+ * of the particle with index i are neigh[offset[i]] to
+ * neigh[offset[i] + nneigh - 1], their distances r[offset[i]] to
+ * r[offset[i] + nneigh - 1]. Every particle's list is padded to a multiple
+ * of NEIGH_LIST_PAD entries.
+ * With NEIGH_LIST_COMPRESSED, the global list keeps neigh and r encoded in
+ * code and rq instead, see part_compress_neighbour_lists(). Use
+ * part_get_neighbours() to read it either way. */
+typedef struct {
+  int *offset; /* index of first entry of every particle; size npart */
+  int *owner;  /* while the lists are being built: thread whose scratch list
+                  holds the entries of every particle; size npart */
+  int *neigh;  /* neighbour particle indices */
+  float *r;    /* distances to neighbours */
+  int nused;   /* number of used entries in neigh and r; in rq with
+                  NEIGH_LIST_COMPRESSED */
+  int nalloc;  /* number of allocated entries in neigh and r; in rq with
+                  NEIGH_LIST_COMPRESSED */
+#ifdef NEIGH_LIST_COMPRESSED
+  int *coffset;        /* index of first byte of every particle in code */
+  float *rscale;       /* largest distance in every particle's list */
+  unsigned char *code; /* encoded neighbour indices */
+  uint16_t *rq;        /* distances in units of rscale / 65535 */
+  int ncalloc;         /* number of allocated bytes in code */
+#endif
+} neighlist;
+
+/* list of all interacting pairs of particles, every pair stored only once:
+ * pair k is made up of particles i[k] < j[k] at distance r[k]. A pair
+ * interacts if r <= max(H_i, H_j). */
+typedef struct {
+  int *i;   /* index of first particle of every pair */
+  int *j;   /* index of second particle of every pair */
+  float *r; /* distance between the particles */
+#ifdef PAIR_LIST_STORE_KERNELS
+  float *Wi;    /* W(r, h_i) */
+  float *Wj;    /* W(r, h_j) */
+  float *dWdri; /* dW/dr(r, h_i) */
+  float *dWdrj; /* dW/dr(r, h_j) */
+#endif
+  int npairs; /* number of pairs */
+  int nalloc; /* number of allocated pairs */
+} pairlist;
+
+/* scratch space of every thread for the smoothing length computation:
+ * arrays for the neighbour candidates of a cell or leaf, and the neighbour
+ * lists of the particles the thread worked on. These are gathered into the
+ * global neighbour list afterwards. Kept around between neighbour
+ * searches. */
+typedef struct {
+  int ncand_alloc; /* size of the candidate arrays */
+  int *allneighs;  /* all neighbour candidates of particles in a cell */
+  int *neighs_p;   /* neighbour candidates of a single particle */
+  float *r;        /* distances of candidates to a single particle */
+  float *x;        /* x coordinates of candidates */
+  float *y;        /* y coordinates of candidates */
+  float *rbatch;   /* squared distances of candidates to H_BATCH_SIZE
+                      particles, interleaved: rbatch[i * H_BATCH_SIZE + b] */
+  float *rkept;    /* distances of the candidates that are close enough to
+                      matter, interleaved like rbatch */
+  neighlist list;  /* neighbour lists this thread produced; offset and owner
+                      are not used */
+} part_scratch;
+
+/* arrays the density sweep tasks work on, see
+ * part_get_smoothing_lengths_sweeps() */
+typedef struct {
+  float *H;       /* compact support radii */
+  float *Hinv;    /* 1 / H */
+  float *Hlo;     /* lower bounds for H */
+  float *Hhi;     /* upper bounds for H */
+  float *wsum;    /* sums of w(q) */
+  float *dwsum;   /* sums of NDIM w + q dw/dq */
+  int *cellof;    /* cell of each particle */
+  int *converged; /* whether H has converged */
+  int *cells;     /* scratch space for ncelltot cell indices per thread */
+  long ndist;     /* number of particle pairs whose distance was computed */
+} part_sweep_data;
+
 void init_part_array(void);
-void init_part(part *p);
+void init_part(int i);
 void free_part_arrays();
+void part_alloc_store(partstore *s, int n);
+void part_free_store(partstore *s);
+void *part_aligned_malloc(size_t size);
+void part_copy(partstore *dst, int j, partstore *src, int i);
+void part_swap(int i, int j);
+void part_init_neighbour_list();
+void part_scratch_reserve(part_scratch *s, int n);
+int part_reserve_neighbours(neighlist *list, int n);
+void part_store_neighbours(int pind, float *r, int *neigh);
+void part_gather_neighbour_lists();
+#ifdef NEIGH_LIST_COMPRESSED
+void part_compress_neighbour_lists();
+#endif
+int part_get_neighbours(int pind, int *neigh, float *r);
+#ifdef WITH_PAIR_LISTS
+void part_build_pair_list();
+void part_get_densities_pairs();
+#endif
+void part_get_id_order(int *order);
+void part_drift(float dt);
 
+void part_find_neighbours(); /* build neighbour search structures, compute
+                                all smoothing lengths */
+#ifdef WITH_VERLET_LISTS
+int part_refresh_verlet_lists();
+#endif
 void part_get_smoothing_lengths(); /* compute all smoothing lengths */
-void part_compute_h(
-    part *p, float *r, int *neighs,
+long part_get_smoothing_lengths_grid();
+#if NDIM == 1
+long part_get_smoothing_lengths_1d();
+int part_compute_h_window(int pind, int k, float *xs, int *ind, int ntot,
+                          part_scratch *s);
+#endif
+#if H_SOLVER == H_SOLVE_SWEEPS
+long part_get_smoothing_lengths_sweeps();
+void part_density_task(task *t, void *data);
+void part_density_self(int c, part_sweep_data *d);
+void part_density_pair(int ci, int cj, part_sweep_data *d);
+void part_density_add(int i, float r, part_sweep_data *d);
+void part_density_ghost(int c, part_sweep_data *d);
+void part_get_density_sums(int pind, int c, float H, float *wsum,
+                           float *dwsum, int *cells);
+#endif
+int part_gather_candidates(part_scratch *s, int *cells, int ncells);
+#if NEIGHBOUR_SEARCH == NGB_TREE
+long part_get_smoothing_lengths_tree();
+#endif
+void part_get_distances(int pind, float *x, float *y, float *r, int n);
+float part_get_pair_distance(int i, int j);
+int part_partition(int start, int n, int dim, float split);
+int part_compute_h(
+    int pind, float *r, int *neighs,
     int nneigh); /* compute smoothing length of given particle */
+int part_filter_candidates(const float *d2, int n, float R, float *rkept);
+int part_compute_h_batch(int *pinds, int nb, part_scratch *s, int *cand,
+                         float *x, float *y, int ncand);
+float part_guess_H(float *r, int *neigh, int nneigh);
+int part_h_newton_step(float *H, float *Hlo, float *Hhi, float wsum,
+                       float dwsum);
+void part_finish_h(int pind, float Hi, float *r, int *neigh, int nneigh);
 
 /* particle STDOUT printing */
 void part_print_all(void);
 void part_print_range(int start, int stop);
-void part_print_properties(part *p);
+void part_print_properties(int i);
 void part_print_header(void);
 
 /* other particle printing routines */
@@ -76,3 +76,101 @@ void quicksort_float_int_follower_recursive(float *arr, int *follower, int lo,
     quicksort_float_int_follower_recursive(arr, follower, i, hi);
   }
 }
+
+float quickselect_float_int_follower(float *arr, int *follower, int len,
+                                     int k) {
+  /* -----------------------------------------------------------
+   * Partially sort arr such that arr[k] is the element that
+   * would be at index k if arr were sorted, all elements before
+   * it are <= arr[k] and all elements after it are >= arr[k].
+   * Returns arr[k].
+   * arr: array to be partially sorted.
+   * follower: array of same length as arr. Will be re-ordered
+   *           the same way arr is being re-ordered.
+   * len: length of arrays
+   * k:   index of element to select
+   * Uses a three-way partition, so arrays with many equal
+   * values (e.g. distances on a lattice) are handled in linear
+   * time as well.
+   * ----------------------------------------------------------- */
+
+  int lo = 0;
+  int hi = len - 1;
+
+  while (lo < hi) {
+    /* pick a pivot: median of first, middle, last element */
+    float a = arr[lo];
+    float b = arr[(lo + hi) / 2];
+    float c = arr[hi];
+    float pivot;
+    if (a < b) {
+      pivot = (b < c) ? b : ((a < c) ? c : a);
+    } else {
+      pivot = (a < c) ? a : ((b < c) ? c : b);
+    }
+
+    /* three-way partition: [lo, lt) < pivot, [lt, i) == pivot,
+     * (gt, hi] > pivot */
+    int lt = lo;
+    int gt = hi;
+    int i = lo;
+    while (i <= gt) {
+      if (arr[i] < pivot) {
+        swap_float_int_follower(arr, follower, i, lt);
+        lt += 1;
+        i += 1;
+      } else if (arr[i] > pivot) {
+        swap_float_int_follower(arr, follower, i, gt);
+        gt -= 1;
+      } else {
+        i += 1;
+      }
+    }
+
+    if (k < lt) {
+      hi = lt - 1;
+    } else if (k > gt) {
+      lo = gt + 1;
+    } else {
+      break; /* arr[k] == pivot */
+    }
+  }
+
+  return (arr[k]);
+}
+
+int partition_float_int_follower(float *arr, int *follower, int len,
+                                 float split) {
+  /* -----------------------------------------------------------
+   * Re-order arr such that all elements <= split come first.
+   * Returns the number of elements <= split.
+   * arr: array to be partitioned.
+   * follower: array of same length as arr. Will be re-ordered
+   *           the same way arr is being re-ordered.
+   * len: length of arrays
+   * ----------------------------------------------------------- */
+
+  int n = 0;
+  for (int i = 0; i < len; i++) {
+    if (arr[i] <= split) {
+      swap_float_int_follower(arr, follower, i, n);
+      n += 1;
+    }
+  }
+
+  return (n);
+}
+
+void swap_float_int_follower(float *arr, int *follower, int i, int j) {
+  /* -----------------------------------------------------------
+   * Swap elements i and j of arr and follower.
+   * ----------------------------------------------------------- */
+
+  float tempf = arr[i];
+  arr[i] = arr[j];
+  arr[j] = tempf;
+
+  int tempi = follower[i];
+  follower[i] = follower[j];
+  follower[j] = tempi;
+}
@@ -9,5 +9,10 @@
 void quicksort_float_int_follower(float *arr, int *follower, int len);
 void quicksort_float_int_follower_recursive(float *arr, int *follower, int lo,
                                             int hi);
+float quickselect_float_int_follower(float *arr, int *follower, int len,
+                                     int k);
+int partition_float_int_follower(float *arr, int *follower, int len,
+                                 float split);
+void swap_float_int_follower(float *arr, int *follower, int i, int j);
 
 #endif
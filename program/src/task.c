@@ -0,0 +1,308 @@
+/* Task based parallelism over the cell grid: tasks for the work within
+ * cells and between pairs of neighbouring cells, run by a dependency
+ * driven scheduler with a work stealing queue per thread */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cell.h"
+#include "params.h"
+#include "task.h"
+#include "utils.h"
+
+extern params pars;
+extern cell *grid;
+
+void sched_init_density(scheduler *s) {
+  /* -------------------------------------------------------
+   * Set up the tasks for a density loop over the cell grid:
+   * a self task for every cell, a pair task for every pair
+   * of neighbouring cells, and a ghost task for every cell
+   * that waits for all self and pair tasks of that cell.
+   * Image cells around the box get no tasks; the ghost
+   * tasks take care of them.
+   * Tasks for later phases would depend on the ghosts.
+   * Tasks are stored as: self tasks for cells 0 to
+   * ncelltot - 1, then ghost tasks in the same order, then
+   * all pair tasks.
+   * ------------------------------------------------------- */
+
+  log_extra("Setting up density tasks");
+
+  int ncells = pars.ncelltot;
+  int neighs[9];
+  int nn;
+
+  /* count pairs */
+  int npairs = 0;
+  for (int c = 0; c < ncells; c++) {
+    cell_get_neighbours_within(&grid[c], 1, neighs, &nn);
+    for (int k = 0; k < nn; k++) {
+      if (neighs[k] > c && neighs[k] < ncells)
+        npairs += 1;
+    }
+  }
+
+  s->ntasks = 2 * ncells + npairs;
+  s->tasks = malloc(s->ntasks * sizeof(task));
+  s->nwait = malloc(s->ntasks * sizeof(int));
+  /* self tasks unlock their ghost, pair tasks the ghosts of both cells */
+  s->unlocks = malloc((ncells + 2 * npairs) * sizeof(int));
+  if (s->tasks == NULL || s->nwait == NULL || s->unlocks == NULL) {
+    throw_error("Couldn't allocate %d tasks", s->ntasks);
+  }
+
+  int *unlock = s->unlocks;
+  for (int c = 0; c < ncells; c++) {
+    task *self = &s->tasks[c];
+    self->type = TASK_SELF;
+    self->ci = c;
+    self->cj = -1;
+    self->nunlock = 1;
+    self->unlock = unlock;
+    self->unlock[0] = ncells + c;
+    unlock += 1;
+    s->nwait[c] = 0;
+
+    task *ghost = &s->tasks[ncells + c];
+    ghost->type = TASK_GHOST;
+    ghost->ci = c;
+    ghost->cj = -1;
+    ghost->nunlock = 0;
+    ghost->unlock = NULL;
+    s->nwait[ncells + c] = 1; /* the self task */
+  }
+
+  int t = 2 * ncells;
+  for (int c = 0; c < ncells; c++) {
+    cell_get_neighbours_within(&grid[c], 1, neighs, &nn);
+    for (int k = 0; k < nn; k++) {
+      if (neighs[k] <= c || neighs[k] >= ncells)
+        continue;
+      task *pair = &s->tasks[t];
+      pair->type = TASK_PAIR;
+      pair->ci = c;
+      pair->cj = neighs[k];
+      pair->nunlock = 2;
+      pair->unlock = unlock;
+      pair->unlock[0] = ncells + c;
+      pair->unlock[1] = ncells + neighs[k];
+      unlock += 2;
+      s->nwait[t] = 0;
+      s->nwait[ncells + c] += 1;
+      s->nwait[ncells + neighs[k]] += 1;
+      t += 1;
+    }
+  }
+
+  s->nqueues = pars.nthreads;
+  s->queues = malloc(s->nqueues * sizeof(taskqueue));
+  if (s->queues == NULL) {
+    throw_error("Couldn't allocate task queues");
+  }
+  for (int q = 0; q < s->nqueues; q++) {
+    s->queues[q].tasks = malloc(s->ntasks * sizeof(int));
+    if (s->queues[q].tasks == NULL) {
+      throw_error("Couldn't allocate task queue");
+    }
+    s->queues[q].count = 0;
+#ifdef _OPENMP
+    omp_init_lock(&s->queues[q].lock);
+#endif
+  }
+
+#ifdef _OPENMP
+  s->celllocks = malloc(ncells * sizeof(omp_lock_t));
+  if (s->celllocks == NULL) {
+    throw_error("Couldn't allocate cell locks");
+  }
+  for (int c = 0; c < ncells; c++) {
+    omp_init_lock(&s->celllocks[c]);
+  }
+#endif
+
+  log_extra("Got %d tasks, %d of them cell pairs", s->ntasks, npairs);
+}
+
+void sched_destroy(scheduler *s) {
+  /* -------------------------------------------------------
+   * Deallocate everything of scheduler s.
+   * ------------------------------------------------------- */
+
+  for (int q = 0; q < s->nqueues; q++) {
+    free(s->queues[q].tasks);
+#ifdef _OPENMP
+    omp_destroy_lock(&s->queues[q].lock);
+#endif
+  }
+  free(s->queues);
+
+#ifdef _OPENMP
+  for (int c = 0; c < pars.ncelltot; c++) {
+    omp_destroy_lock(&s->celllocks[c]);
+  }
+  free(s->celllocks);
+#endif
+
+  free(s->tasks);
+  free(s->nwait);
+  free(s->unlocks);
+}
+
+void sched_run(scheduler *s, void (*fun)(task *t, void *data), void *data) {
+  /* -------------------------------------------------------
+   * Run all tasks of scheduler s by calling fun(task, data)
+   * for each of them. A task becomes ready once all tasks
+   * it depends on are done; it is then put in the queue of
+   * the thread that finished the last of them. Threads
+   * take tasks from their own queue first, and steal from
+   * the others when theirs is empty. A task only runs once
+   * it holds the locks of the cells it writes to.
+   * ------------------------------------------------------- */
+
+  for (int t = 0; t < s->ntasks; t++) {
+    s->tasks[t].wait = s->nwait[t];
+  }
+  s->nleft = s->ntasks;
+
+  /* hand out the tasks that are ready now round robin */
+  int q = 0;
+  for (int t = 0; t < s->ntasks; t++) {
+    if (s->tasks[t].wait == 0) {
+      sched_enqueue(s, q, t);
+      q = (q + 1) % s->nqueues;
+    }
+  }
+
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+  {
+    int tid = 0;
+#ifdef _OPENMP
+    tid = omp_get_thread_num() % s->nqueues;
+#endif
+
+    while (1) {
+      int nleft;
+#ifdef _OPENMP
+#pragma omp atomic read
+#endif
+      nleft = s->nleft;
+      if (nleft == 0)
+        break;
+
+      int t = sched_get_task(s, tid);
+      if (t < 0)
+        continue; /* nothing ready right now */
+
+      task *tk = &s->tasks[t];
+      fun(tk, data);
+      sched_unlock_cells(s, tk);
+
+      for (int k = 0; k < tk->nunlock; k++) {
+        task *u = &s->tasks[tk->unlock[k]];
+        int wait;
+#ifdef _OPENMP
+#pragma omp atomic capture
+#endif
+        wait = --u->wait;
+        if (wait == 0)
+          sched_enqueue(s, tid, tk->unlock[k]);
+      }
+
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+      s->nleft -= 1;
+    }
+  }
+}
+
+void sched_enqueue(scheduler *s, int q, int t) {
+  /* -------------------------------------------------------
+   * Add task with index t to queue q.
+   * ------------------------------------------------------- */
+
+  taskqueue *tq = &s->queues[q];
+#ifdef _OPENMP
+  omp_set_lock(&tq->lock);
+#endif
+  tq->tasks[tq->count] = t;
+  tq->count += 1;
+#ifdef _OPENMP
+  omp_unset_lock(&tq->lock);
+#endif
+}
+
+int sched_get_task(scheduler *s, int q) {
+  /* -------------------------------------------------------
+   * Get a task to run for the thread owning queue q, and
+   * take the locks of its cells. Look in queue q first,
+   * then steal from the other queues. Tasks are taken from
+   * the back of the queues, so the thread continues with
+   * the ones it unlocked last, which work on data it
+   * touched recently.
+   * Returns the task index, or -1 if there is no task
+   * that can run right now.
+   * ------------------------------------------------------- */
+
+  for (int k = 0; k < s->nqueues; k++) {
+    taskqueue *tq = &s->queues[(q + k) % s->nqueues];
+#ifdef _OPENMP
+    omp_set_lock(&tq->lock);
+#endif
+    for (int i = tq->count - 1; i >= 0; i--) {
+      int t = tq->tasks[i];
+      if (sched_lock_cells(s, &s->tasks[t])) {
+        tq->count -= 1;
+        tq->tasks[i] = tq->tasks[tq->count];
+#ifdef _OPENMP
+        omp_unset_lock(&tq->lock);
+#endif
+        return (t);
+      }
+    }
+#ifdef _OPENMP
+    omp_unset_lock(&tq->lock);
+#endif
+  }
+
+  return (-1);
+}
+
+int sched_lock_cells(scheduler *s, task *t) {
+  /* -------------------------------------------------------
+   * Try to take the locks of the cells task t writes to.
+   * Ghost tasks don't need any: they only run once all
+   * other tasks of their cell are done.
+   * Returns 1 if the task holds all its locks now, 0 if
+   * it didn't get them. Then it holds none of them.
+   * ------------------------------------------------------- */
+
+#ifdef _OPENMP
+  if (t->type == TASK_GHOST)
+    return (1);
+  if (!omp_test_lock(&s->celllocks[t->ci]))
+    return (0);
+  if (t->type == TASK_PAIR && !omp_test_lock(&s->celllocks[t->cj])) {
+    omp_unset_lock(&s->celllocks[t->ci]);
+    return (0);
+  }
+#endif
+  return (1);
+}
+
+void sched_unlock_cells(scheduler *s, task *t) {
+  /* -------------------------------------------------------
+   * Release the cell locks task t holds.
+   * ------------------------------------------------------- */
+
+#ifdef _OPENMP
+  if (t->type == TASK_GHOST)
+    return;
+  omp_unset_lock(&s->celllocks[t->ci]);
+  if (t->type == TASK_PAIR)
+    omp_unset_lock(&s->celllocks[t->cj]);
+#endif
+}
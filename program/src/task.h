@@ -0,0 +1,58 @@
+/* Task based parallelism over the cell grid: tasks for the work within
+ * cells and between pairs of neighbouring cells, run by a dependency
+ * driven scheduler with a work stealing queue per thread */
+
+#ifndef TASK_H
+#define TASK_H
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/* task types */
+#define TASK_SELF 1  /* interactions of particles within a cell */
+#define TASK_PAIR 2  /* interactions between two neighbouring cells */
+#define TASK_GHOST 3 /* work on the particles of a cell once all of its
+                        interactions are done */
+
+typedef struct {
+  int type;    /* TASK_SELF, TASK_PAIR, or TASK_GHOST */
+  int ci;      /* cell the task works on */
+  int cj;      /* second cell of pair tasks; -1 otherwise */
+  int wait;    /* number of unfinished tasks this one depends on */
+  int nunlock; /* number of tasks that depend on this one */
+  int *unlock; /* indices of the tasks that depend on this one */
+} task;
+
+/* queue of tasks that are ready to run. Every thread has its own. */
+typedef struct {
+  int *tasks; /* task indices; space for all tasks */
+  int count;  /* number of tasks in queue */
+#ifdef _OPENMP
+  omp_lock_t lock;
+#endif
+} taskqueue;
+
+typedef struct {
+  task *tasks;       /* all tasks */
+  int ntasks;        /* number of tasks */
+  int *unlocks;      /* storage for the unlock lists of all tasks */
+  int *nwait;        /* number of dependencies of every task */
+  taskqueue *queues; /* one queue per thread */
+  int nqueues;       /* number of queues */
+  int nleft;         /* number of tasks not done yet in current run */
+#ifdef _OPENMP
+  omp_lock_t *celllocks; /* one lock per cell: tasks that write to the
+                            particles of a cell hold its lock */
+#endif
+} scheduler;
+
+void sched_init_density(scheduler *s);
+void sched_destroy(scheduler *s);
+void sched_run(scheduler *s, void (*fun)(task *t, void *data), void *data);
+void sched_enqueue(scheduler *s, int q, int t);
+int sched_get_task(scheduler *s, int q);
+int sched_lock_cells(scheduler *s, task *t);
+void sched_unlock_cells(scheduler *s, task *t);
+
+#endif
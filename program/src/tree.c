@@ -0,0 +1,284 @@
+/* Adaptive tree for neighbour searches: a binary tree in 1D,
+ * a quadtree in 2D */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "defines.h"
+#include "params.h"
+#include "particles.h"
+#include "tree.h"
+#include "utils.h"
+
+extern params pars;
+extern partstore particles;
+extern treenode *tree;
+
+void tree_build() {
+  /* -------------------------------------------------------
+   * Build the tree: Start with a root node covering the
+   * entire box, and split nodes until every leaf contains
+   * at most TREE_LEAF_SIZE_FACT * nngb particles.
+   * While splitting, the particles are re-ordered such
+   * that the particles of every node are stored
+   * contiguously at indices offset to offset + npic - 1.
+   * The tree is just a 1D array of nodes, the root being
+   * the first element.
+   * ------------------------------------------------------- */
+
+  log_extra("Building tree");
+
+  pars.ntreenodes = 0;
+  pars.ntreenodes_alloc = pars.npart / (int)(pars.nngb + 1.) + 1;
+  tree = malloc(pars.ntreenodes_alloc * sizeof(treenode));
+
+  float center[2] = {0.5 * BOXLEN, 0.};
+#if NDIM == 2
+  center[1] = 0.5 * BOXLEN;
+#endif
+
+  int root = tree_new_node(center, 0.5 * BOXLEN, 0, pars.npart);
+  tree_split_node(root, 0);
+
+  /* debugging notes and checks */
+  if (pars.verbose >= 3) {
+    int nleaves = 0;
+    int npmin = pars.npart;
+    int npmax = 0;
+    for (int n = 0; n < pars.ntreenodes; n++) {
+      if (!tree[n].leaf)
+        continue;
+      nleaves += 1;
+      if (tree[n].npic < npmin)
+        npmin = tree[n].npic;
+      if (tree[n].npic > npmax)
+        npmax = tree[n].npic;
+    }
+    debugmessage("Tree: %d nodes, %d leaves", pars.ntreenodes, nleaves);
+    debugmessage("  Particles in leaves: Min %4d, Max %4d, Mean %.3f", npmin,
+                 npmax, (float)pars.npart / (float)nleaves);
+  }
+}
+
+void tree_destroy() {
+  /* -------------------------------------
+   * dealloc the tree
+   * ------------------------------------- */
+
+  log_extra("Deallocating tree");
+
+  free(tree);
+  tree = NULL;
+  pars.ntreenodes = 0;
+  pars.ntreenodes_alloc = 0;
+}
+
+int tree_new_node(float center[2], float hw, int offset, int npic) {
+  /* -------------------------------------------------------
+   * Add a new node to the tree array, growing the array if
+   * necessary. Returns the index of the new node.
+   * center: center of the region the node covers
+   * hw:     half width of the region the node covers
+   * offset: index of first particle of the node
+   * npic:   number of particles in the node
+   * ------------------------------------------------------- */
+
+  if (pars.ntreenodes == pars.ntreenodes_alloc) {
+    pars.ntreenodes_alloc *= 2;
+    tree = realloc(tree, pars.ntreenodes_alloc * sizeof(treenode));
+    if (tree == NULL) {
+      throw_error("Couldn't grow tree to %d nodes", pars.ntreenodes_alloc);
+    }
+  }
+
+  int n = pars.ntreenodes;
+  pars.ntreenodes += 1;
+
+  treenode *node = &tree[n];
+  node->center[0] = center[0];
+  node->center[1] = center[1];
+  node->hw = hw;
+  node->bmin[0] = 0.;
+  node->bmin[1] = 0.;
+  node->bmax[0] = 0.;
+  node->bmax[1] = 0.;
+  node->npic = npic;
+  node->offset = offset;
+  node->leaf = 1;
+  for (int c = 0; c < TREE_NCHILD; c++) {
+    node->child[c] = -1;
+  }
+
+  return (n);
+}
+
+void tree_split_node(int n, int depth) {
+  /* -------------------------------------------------------
+   * Recursively split node with index n into its children
+   * if it contains too many particles, then compute its
+   * particle bounding box.
+   * The particles of the node are partitioned in place
+   * along each dimension, so every child's particles are
+   * contiguous.
+   * Note: the tree array may be re-allocated while adding
+   * new nodes, so don't keep pointers to nodes around.
+   * ------------------------------------------------------- */
+
+  int offset = tree[n].offset;
+  int npic = tree[n].npic;
+
+  if (npic > TREE_LEAF_SIZE_FACT * pars.nngb && depth < TREE_MAX_DEPTH) {
+
+    tree[n].leaf = 0;
+
+    /* start and number of particles of each child */
+    int start[TREE_NCHILD];
+    int count[TREE_NCHILD];
+
+    /* partition along x */
+    int nleft = part_partition(offset, npic, 0, tree[n].center[0]);
+#if NDIM == 1
+    start[0] = offset;
+    count[0] = nleft;
+    start[1] = offset + nleft;
+    count[1] = npic - nleft;
+#elif NDIM == 2
+    /* now partition both halves along y */
+    int nlb = part_partition(offset, nleft, 1, tree[n].center[1]);
+    int nrb =
+        part_partition(offset + nleft, npic - nleft, 1, tree[n].center[1]);
+    /* child index: 0: left bottom; 1: right bottom; 2: left top;
+     * 3: right top */
+    start[0] = offset;
+    count[0] = nlb;
+    start[2] = offset + nlb;
+    count[2] = nleft - nlb;
+    start[1] = offset + nleft;
+    count[1] = nrb;
+    start[3] = offset + nleft + nrb;
+    count[3] = npic - nleft - nrb;
+#endif
+
+    float hw = 0.5 * tree[n].hw;
+    for (int c = 0; c < TREE_NCHILD; c++) {
+      if (count[c] == 0)
+        continue;
+      float center[2];
+      center[0] = tree[n].center[0] + (c % 2 == 0 ? -hw : hw);
+      center[1] = 0.;
+#if NDIM == 2
+      center[1] = tree[n].center[1] + (c / 2 == 0 ? -hw : hw);
+#endif
+      int child = tree_new_node(center, hw, start[c], count[c]);
+      tree[n].child[c] = child;
+      tree_split_node(child, depth + 1);
+    }
+  }
+
+  /* get bounding box of the particles in this node */
+  treenode *node = &tree[n];
+  node->bmin[0] = BOXLEN;
+  node->bmin[1] = BOXLEN;
+  node->bmax[0] = 0.;
+  node->bmax[1] = 0.;
+#if NDIM == 1
+  node->bmin[1] = 0.;
+#endif
+
+  if (node->leaf) {
+    for (int P = offset; P < offset + npic; P++) {
+      for (int k = 0; k < NDIM; k++) {
+        if (particles.x[k][P] < node->bmin[k])
+          node->bmin[k] = particles.x[k][P];
+        if (particles.x[k][P] > node->bmax[k])
+          node->bmax[k] = particles.x[k][P];
+      }
+    }
+  } else {
+    for (int c = 0; c < TREE_NCHILD; c++) {
+      if (node->child[c] < 0)
+        continue;
+      treenode *child = &tree[node->child[c]];
+      for (int k = 0; k < NDIM; k++) {
+        if (child->bmin[k] < node->bmin[k])
+          node->bmin[k] = child->bmin[k];
+        if (child->bmax[k] > node->bmax[k])
+          node->bmax[k] = child->bmax[k];
+      }
+    }
+  }
+}
+
+void tree_get_neighbour_leaves(treenode *leaf, float R, int *neighs,
+                               int *nneighs) {
+  /* ---------------------------------------------------------
+   * Find the indices of all leaves that contain particles
+   * which may be within a distance R of any particle of the
+   * given leaf and write them (including the leaf itself)
+   * into the neighs array. Write how many entries are in
+   * that array in nneighs integer.
+   * neighs must have space for all leaves of the tree.
+   * --------------------------------------------------------- */
+
+  *nneighs = 0;
+  tree_walk(0, leaf, R, neighs, nneighs);
+}
+
+void tree_walk(int n, treenode *leaf, float R, int *neighs, int *nneighs) {
+  /* ---------------------------------------------------------
+   * Recursively walk the tree starting at node n and add all
+   * leaves whose particle bounding boxes are within a
+   * distance R of the particle bounding box of the given leaf
+   * to the neighs array.
+   * --------------------------------------------------------- */
+
+  treenode *node = &tree[n];
+
+  if (tree_box_distance(leaf, node) > R)
+    return;
+
+  if (node->leaf) {
+    neighs[*nneighs] = n;
+    *nneighs += 1;
+    return;
+  }
+
+  for (int c = 0; c < TREE_NCHILD; c++) {
+    if (node->child[c] >= 0) {
+      tree_walk(node->child[c], leaf, R, neighs, nneighs);
+    }
+  }
+}
+
+float tree_box_distance(treenode *a, treenode *b) {
+  /* ---------------------------------------------------------
+   * Get the minimal distance between the particle bounding
+   * boxes of nodes a and b, taking periodicity into account
+   * if necessary.
+   * --------------------------------------------------------- */
+
+  float d2 = 0.;
+
+  for (int k = 0; k < NDIM; k++) {
+    float gap = 0.;
+    if (b->bmin[k] > a->bmax[k]) {
+      gap = b->bmin[k] - a->bmax[k];
+    } else if (a->bmin[k] > b->bmax[k]) {
+      gap = a->bmin[k] - b->bmax[k];
+    }
+
+    if (pars.boundary == BOUNDARY_PERIODIC) {
+      /* the gap going through the periodic boundary */
+      float hi = a->bmax[k] > b->bmax[k] ? a->bmax[k] : b->bmax[k];
+      float lo = a->bmin[k] < b->bmin[k] ? a->bmin[k] : b->bmin[k];
+      float gapper = BOXLEN - (hi - lo);
+      if (gapper < gap)
+        gap = gapper;
+    }
+
+    d2 += gap * gap;
+  }
+
+  return (sqrtf(d2));
+}
@@ -0,0 +1,42 @@
+/* Adaptive tree for neighbour searches: a binary tree in 1D,
+ * a quadtree in 2D */
+
+#ifndef TREE_H
+#define TREE_H
+
+#include "defines.h"
+
+#if NDIM == 1
+#define TREE_NCHILD 2
+#elif NDIM == 2
+#define TREE_NCHILD 4
+#endif
+
+typedef struct {
+
+  float center[2]; /* center of the region this node covers */
+  float hw;        /* half width of the region this node covers */
+
+  float bmin[2]; /* lower corner of bounding box of particles in this node */
+  float bmax[2]; /* upper corner of bounding box of particles in this node */
+
+  int npic;   /* number of particles in this node */
+  int offset; /* index of first particle of this node in the (tree-ordered)
+                 particles array */
+
+  int leaf;                /* whether this node is a leaf */
+  int child[TREE_NCHILD];  /* indices of child nodes in tree array; -1 if the
+                              child contains no particles */
+
+} treenode;
+
+void tree_build();
+void tree_destroy();
+int tree_new_node(float center[2], float hw, int offset, int npic);
+void tree_split_node(int n, int depth);
+void tree_get_neighbour_leaves(treenode *leaf, float R, int *neighs,
+                               int *nneighs);
+void tree_walk(int n, treenode *leaf, float R, int *neighs, int *nneighs);
+float tree_box_distance(treenode *a, treenode *b);
+
+#endif
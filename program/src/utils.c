@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "params.h"
 #include "utils.h"
@@ -57,6 +58,38 @@ void print_compile_defines() {
   log_message("Dimensions:                  " STR(NDIM) "\n");
   log_message("Hydro solver:                %s\n", solver);
   log_message("Kernel:                      %s\n", kernel);
+#ifdef KERNEL_TABULATED
+#if KERNEL_TABLE_INTERP == KERNEL_INTERP_LINEAR
+  log_message("Kernel evaluation:           table, %d intervals, linear\n",
+              KERNEL_TABLE_SIZE);
+#else
+  log_message("Kernel evaluation:           table, %d intervals, cubic\n",
+              KERNEL_TABLE_SIZE);
+#endif
+#else
+  log_message("Kernel evaluation:           analytic\n");
+#endif
+#if NEIGHBOUR_SEARCH == NGB_TREE
+  log_message("Neighbour search:            tree\n");
+#elif defined(CELL_GRID_SPARSE)
+  log_message("Neighbour search:            sparse grid\n");
+#else
+  log_message("Neighbour search:            grid\n");
+#if H_SOLVER == H_SOLVE_SWEEPS
+  log_message("Smoothing lengths:           density sweeps\n");
+#else
+  log_message("Smoothing lengths:           batches of %d\n", H_BATCH_SIZE);
+#endif
+#endif
+#if defined(WITHOUT_NEIGHBOUR_LISTS)
+  log_message("Neighbour storage:           none, recomputed\n");
+#elif defined(WITH_PAIR_LISTS)
+  log_message("Neighbour storage:           pair lists\n");
+#elif defined(NEIGH_LIST_COMPRESSED)
+  log_message("Neighbour storage:           compressed per-particle lists\n");
+#else
+  log_message("Neighbour storage:           per-particle lists\n");
+#endif
 }
 
 void utils_get_macro_strings(char *solver, char *kernel) {
@@ -217,13 +250,14 @@ void printbool(int boolean) {
   }
 }
 
-float to_ndim_power(float x) {
+double wall_time() {
   /* ----------------------------------
-   * Return x^ndim
+   * Return wall clock time in seconds.
+   * Unlike clock(), this doesn't add
+   * up the CPU time of all threads.
    * ---------------------------------- */
-#if NDIM == 1
-  return (x);
-#elif NDIM == 2
-  return (x * x);
-#endif
+
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (ts.tv_sec + 1e-9 * ts.tv_nsec);
 }
@@ -19,6 +19,17 @@ void debugmessage(const char *format, ...);
 void log_extra(const char *format, ...);
 void throw_error(const char *format, ...);
 void printbool(int boolean);
-float to_ndim_power(float x);
+double wall_time();
+
+static inline float to_ndim_power(float x) {
+  /* ----------------------------------
+   * Return x^ndim
+   * ---------------------------------- */
+#if NDIM == 1
+  return (x);
+#elif NDIM == 2
+  return (x * x);
+#endif
+}
 
 #endif